@@ -0,0 +1,178 @@
+#include <linux/overflow.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+
+#include "rwsem_sparse.h"
+#include "scull.h"
+
+/*
+ * by offset, so that a batch walks the qsets once in order; the array
+ * order breaks ties
+ */
+static int scull_batch_cmp(const void *a, const void *b)
+{
+	const	struct	scull_batch_ent	*ea = *(struct scull_batch_ent **)a;
+	const	struct	scull_batch_ent	*eb = *(struct scull_batch_ent **)b;
+
+	if (ea->offset != eb->offset)
+		return (ea->offset < eb->offset ? -1 : 1);
+	return (ea < eb ? -1 : ea > eb);
+}
+
+/* past the last byte of ent, saturated; scull_batch_one() checks it */
+static u64 scull_batch_end(const struct scull_batch_ent *ent)
+{
+	u64 end;
+
+	if (check_add_overflow(ent->offset, (u64)ent->len, &end))
+		return (U64_MAX);
+	return (end);
+}
+
+/*
+ * a write overlapping another entry, in the sorted order: the batch
+ * must then run in array order, or the read would see the write, or
+ * not, depending on where each one starts
+ */
+static bool scull_batch_conflicts(struct scull_batch_ent **order, size_t nr)
+{
+	const	struct	scull_batch_ent	*ent;
+	u64	end = 0, wend = 0;
+	size_t	i;
+
+	for (i = 0; i < nr; i++) {
+		ent = order[i];
+		if (ent->len == 0)
+			continue;
+		if (ent->offset < wend ||
+		    (ent->op == SCULL_BATCH_WRITE && ent->offset < end))
+			return (true);
+		end = max(end, scull_batch_end(ent));
+		if (ent->op == SCULL_BATCH_WRITE)
+			wend = max(wend, scull_batch_end(ent));
+	}
+	return (false);
+}
+
+static ssize_t scull_batch_one(struct scull_dev *dev,
+		struct scull_store *store, struct file *filp,
+		const struct scull_batch_ent *ent)
+{
+	struct	iov_iter	iter;
+	struct	iovec	iov;
+	loff_t	pos = ent->offset;
+	u64	end;
+	int	ret;
+
+	/* no more than one read(2) moves, negative as an int past that */
+	if (ent->len > MAX_RW_COUNT)
+		return (-EINVAL);
+	if (check_add_overflow(ent->offset, (u64)ent->len, &end) ||
+	    end > MAX_LFS_FILESIZE)
+		return (-EFBIG);
+	if (ent->op == SCULL_BATCH_READ) {
+		if (!(filp->f_mode & FMODE_READ))
+			return (-EBADF);
+		ret = import_single_range(READ, u64_to_user_ptr(ent->buf),
+				ent->len, &iov, &iter);
+		if (ret)
+			return (ret);
+		return (__scull_read(store, &iter, &pos, false));
+	}
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return (-EBADF);
+	ret = import_single_range(WRITE, u64_to_user_ptr(ent->buf), ent->len,
+			&iov, &iter);
+	if (ret)
+		return (ret);
+	return (__scull_write(dev, store, &iter, &pos, false));
+}
+
+/*
+ * SCULL_IOCBATCH: readers go under scull_srcu like scull_read_iter(); a
+ * batch holding writes also takes dev->lock for reading, once
+ */
+long scull_batch(struct scull_dev *dev, struct file *filp,
+		struct scull_batch_ent __user *uents, size_t nr)
+{
+	struct	scull_batch_ent	*ents, **order;
+	struct	scull_store	*store;
+	bool	writes = false;
+	u64	end = 0;
+	ssize_t	res;
+	size_t	i;
+	long	ret = 0;
+	int	idx;
+
+	if (nr == 0)
+		return (0);
+	if (nr > SCULL_BATCH_MAX)
+		return (-E2BIG);
+	ents = kvmalloc_array(nr, sizeof(*ents), GFP_KERNEL);
+	order = kvmalloc_array(nr, sizeof(*order), GFP_KERNEL);
+	if (ents == NULL || order == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(ents, uents, nr * sizeof(*ents))) {
+		ret = -EFAULT;
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		if (ents[i].op != SCULL_BATCH_READ &&
+		    ents[i].op != SCULL_BATCH_WRITE) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if (ents[i].op == SCULL_BATCH_WRITE) {
+			writes = true;
+			end = max(end, scull_batch_end(&ents[i]));
+		}
+		ents[i].result = -EINTR;
+		order[i] = &ents[i];
+	}
+	sort(order, nr, sizeof(*order), scull_batch_cmp, NULL);
+	if (scull_batch_conflicts(order, nr))
+		for (i = 0; i < nr; i++)
+			order[i] = &ents[i];
+
+	if (writes) {
+		if (__down_read_killable_sparse(&dev->lock)) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		/* the full geometry first, like scull_write_iter() */
+		__scull_store_grow(dev, scull_store_locked(dev),
+				min_t(u64, end, MAX_LFS_FILESIZE));
+	}
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	for (i = 0; i < nr; i++) {
+		res = scull_batch_one(dev, store, filp, order[i]);
+		/* the rest keeps -EINTR */
+		if (res == -ERESTARTSYS)
+			break;
+		order[i]->result = res;
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+	srcu_read_unlock(&scull_srcu, idx);
+	if (writes) {
+		scull_spill_check(store);
+		__up_read_sparse(&dev->lock);
+	}
+
+	for (i = 0; i < nr; i++)
+		if (put_user(ents[i].result, &uents[i].result)) {
+			ret = -EFAULT;
+			break;
+		}
+out:
+	kvfree(order);
+	kvfree(ents);
+	return (ret);
+}
@@ -0,0 +1,272 @@
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/falloc.h>
+#include <linux/genhd.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+#include "rwsem_sparse.h"
+#include "scull.h"
+
+/*
+ * the first scull_nr_blk devices are also block devices, scullb0 and
+ * on, of scull_blk_size bytes each. Requests go straight to the quanta
+ * of the device, like its read_iter/write_iter would; what was never
+ * written reads as zeroes, discards punch holes. A trim through the
+ * character device empties the disk as well.
+ */
+
+/* one hardware queue per cpu, requests in flight on each */
+#ifndef SCULL_BLK_DEPTH
+#define SCULL_BLK_DEPTH		128
+#endif
+
+struct scull_blk {
+	struct	scull_dev	*dev;
+	struct	blk_mq_tag_set	 set;
+	struct	gendisk		*disk;
+};
+
+static int		 scull_blk_major;
+static struct scull_blk	*scull_blks;
+
+static const struct block_device_operations scull_blk_fops = {
+	.owner =	THIS_MODULE,
+};
+
+/*
+ * beyond the end of the store everything is a hole; short of it, a
+ * short read is an error (a quantum could not be inflated or read back)
+ */
+static blk_status_t scull_blk_read(struct scull_dev *dev, struct bio_vec *bv,
+		loff_t pos)
+{
+	struct	scull_store	*store;
+	struct	iov_iter	iter;
+	size_t	len, want;
+	ssize_t	n;
+	int	idx;
+
+	iov_iter_bvec(&iter, READ, bv, 1, bv->bv_len);
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	len = smp_load_acquire(&store->len);
+	want = pos < (loff_t)len ? min_t(size_t, bv->bv_len, len - pos) : 0;
+	n = 0;
+	if (want != 0) {
+		iov_iter_truncate(&iter, want);
+		n = __scull_read(store, &iter, &pos, false);
+	}
+	srcu_read_unlock(&scull_srcu, idx);
+	if (n < 0)
+		return (errno_to_blk_status(n));
+	if ((size_t)n != want)
+		return (BLK_STS_IOERR);
+	iov_iter_reexpand(&iter, bv->bv_len - want);
+	if (iov_iter_count(&iter) != 0)
+		iov_iter_zero(iov_iter_count(&iter), &iter);
+	return (BLK_STS_OK);
+}
+
+static blk_status_t scull_blk_write(struct scull_dev *dev,
+		struct bio_vec *bv, loff_t pos)
+{
+	struct	scull_store	*store;
+	struct	iov_iter	iter;
+	ssize_t	n;
+
+	iov_iter_bvec(&iter, WRITE, bv, 1, bv->bv_len);
+	__down_read_sparse(&dev->lock);
+	store = __scull_store_grow(dev, scull_store_locked(dev),
+			pos + bv->bv_len);
+	n = __scull_write(dev, store, &iter, &pos, false);
+	scull_spill_check(store);
+	__up_read_sparse(&dev->lock);
+	if (n < 0)
+		return (errno_to_blk_status(n));
+	return ((size_t)n == bv->bv_len ? BLK_STS_OK : BLK_STS_IOERR);
+}
+
+static blk_status_t scull_blk_rw(struct scull_dev *dev, struct request *rq)
+{
+	struct	req_iterator	iter;
+	struct	bio_vec		bv;
+	loff_t	pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	blk_status_t	sts = BLK_STS_OK;
+
+	rq_for_each_segment(bv, rq, iter) {
+		if (rq_data_dir(rq) == WRITE)
+			sts = scull_blk_write(dev, &bv, pos);
+		else
+			sts = scull_blk_read(dev, &bv, pos);
+		if (sts != BLK_STS_OK)
+			break;
+		pos += bv.bv_len;
+	}
+	return (sts);
+}
+
+/*
+ * requests may sleep on the device and qset locks and allocate quanta,
+ * the tag set is BLK_MQ_F_BLOCKING
+ */
+static blk_status_t scull_blk_queue_rq(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct	scull_dev	*dev = hctx->queue->queuedata;
+	struct	request		*rq = bd->rq;
+	blk_status_t	sts;
+	long	ret;
+
+	blk_mq_start_request(rq);
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		sts = scull_blk_rw(dev, rq);
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		ret = scull_fallocate(dev,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				(loff_t)blk_rq_pos(rq) << SECTOR_SHIFT,
+				blk_rq_bytes(rq));
+		sts = errno_to_blk_status(ret);
+		break;
+	case REQ_OP_FLUSH:
+		/* only a pmem backed device has anything to make durable */
+		if (dev->dax != NULL)
+			scull_dax_flush(dev->dax);
+		sts = BLK_STS_OK;
+		break;
+	default:
+		sts = BLK_STS_NOTSUPP;
+		break;
+	}
+	blk_mq_end_request(rq, sts);
+	return (BLK_STS_OK);
+}
+
+static const struct blk_mq_ops scull_blk_mq_ops = {
+	.queue_rq =	scull_blk_queue_rq,
+};
+
+static int scull_blk_setup(struct scull_blk *blk, struct scull_dev *dev,
+		int i)
+{
+	struct	request_queue	*q;
+	loff_t	size = scull_blk_size;
+	int	ret;
+
+	/* no more than its persistent memory holds */
+	if (dev->dax != NULL)
+		size = min(size, scull_dax_size(dev->dax));
+	blk->dev = dev;
+	blk->set.ops = &scull_blk_mq_ops;
+	blk->set.nr_hw_queues = nr_cpu_ids;
+	blk->set.queue_depth = SCULL_BLK_DEPTH;
+	blk->set.numa_node = NUMA_NO_NODE;
+	blk->set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	ret = blk_mq_alloc_tag_set(&blk->set);
+	if (ret)
+		return (ret);
+
+	q = blk_mq_init_queue(&blk->set);
+	if (IS_ERR(q)) {
+		blk_mq_free_tag_set(&blk->set);
+		return (PTR_ERR(q));
+	}
+	q->queuedata = dev;
+	blk_queue_physical_block_size(q, PAGE_SIZE);
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, q);
+	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, q);
+	/* holes are free, discards give the quanta back */
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+	q->limits.discard_granularity = PAGE_SIZE;
+	blk_queue_max_discard_sectors(q, UINT_MAX >> SECTOR_SHIFT);
+	blk_queue_max_write_zeroes_sectors(q, UINT_MAX >> SECTOR_SHIFT);
+	/* flushes are only sent to a queue with a volatile cache */
+	if (dev->dax != NULL)
+		blk_queue_write_cache(q, true, false);
+
+	blk->disk = alloc_disk(1);
+	if (blk->disk == NULL) {
+		blk_cleanup_queue(q);
+		blk_mq_free_tag_set(&blk->set);
+		return (-ENOMEM);
+	}
+	blk->disk->major = scull_blk_major;
+	blk->disk->first_minor = i;
+	blk->disk->fops = &scull_blk_fops;
+	blk->disk->queue = q;
+	blk->disk->private_data = dev;
+	snprintf(blk->disk->disk_name, DISK_NAME_LEN, "scullb%d", i);
+	set_capacity(blk->disk, size >> SECTOR_SHIFT);
+	add_disk(blk->disk);
+	return (0);
+}
+
+static void scull_blk_teardown(struct scull_blk *blk)
+{
+	struct request_queue *q;
+
+	if (blk->disk == NULL)
+		return;
+	q = blk->disk->queue;
+	del_gendisk(blk->disk);
+	blk_cleanup_queue(q);
+	put_disk(blk->disk);
+	blk_mq_free_tag_set(&blk->set);
+	blk->disk = NULL;
+}
+
+/*
+ * after the devices are set up
+ */
+int scull_blk_init(void)
+{
+	size_t	i;
+	int	ret;
+
+	if (scull_nr_blk == 0)
+		return (0);
+	if (scull_nr_blk > scull_nr_devs || scull_nr_blk > DISK_MAX_PARTS ||
+	    (scull_blk_size >> SECTOR_SHIFT) == 0 ||
+	    scull_blk_size > MAX_LFS_FILESIZE)
+		return (-EINVAL);
+
+	ret = register_blkdev(0, "scullb");
+	if (ret < 0)
+		return (ret);
+	scull_blk_major = ret;
+	scull_blks = kcalloc(scull_nr_blk, sizeof(*scull_blks), GFP_KERNEL);
+	if (scull_blks == NULL) {
+		scull_blk_cleanup();
+		return (-ENOMEM);
+	}
+	for (i = 0; i < scull_nr_blk; i++) {
+		ret = scull_blk_setup(&scull_blks[i], &scull_devices[i], i);
+		if (ret) {
+			scull_blk_cleanup();
+			return (ret);
+		}
+	}
+	return (0);
+}
+
+/*
+ * before the devices go
+ */
+void scull_blk_cleanup(void)
+{
+	size_t i;
+
+	if (scull_blks != NULL) {
+		for (i = 0; i < scull_nr_blk; i++)
+			scull_blk_teardown(&scull_blks[i]);
+		kfree(scull_blks);
+		scull_blks = NULL;
+	}
+	if (scull_blk_major > 0)
+		unregister_blkdev(scull_blk_major, "scullb");
+	scull_blk_major = 0;
+}
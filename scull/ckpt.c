@@ -0,0 +1,419 @@
+#include <linux/fadvise.h>
+#include <linux/fs.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+#include "rwsem_sparse.h"
+#include "scull.h"
+
+/*
+ * contents of all devices in one image file, written by
+ * SCULL_IOCTCHECKPOINT and read back at load time from scull_restore.
+ * Each device is taken like a snapshot, then streamed without its lock.
+ *
+ * The image holds, little endian: a header, and for each device its
+ * geometry followed by runs of consecutive quanta, holes left out. A run
+ * of no quanta ends the device
+ */
+static char *scull_restore;
+module_param(scull_restore, charp, S_IRUGO);
+
+#define SCULL_CKPT_MAGIC	0x504b4353	/* "SCKP" */
+#define SCULL_CKPT_VERSION	1
+
+/* quanta of a run at most, each run is one read or write */
+#ifndef SCULL_CKPT_RUN
+#define SCULL_CKPT_RUN		256
+#endif
+
+/* the store started out compact, see __scull_store_geometry() */
+#define SCULL_CKPT_COMPACT	1
+/* persistent already, left out and left alone on restore (dax.c) */
+#define SCULL_CKPT_DAX		2
+
+struct scull_ckpt_hdr {
+	__le32	magic;
+	__le32	version;
+	__le64	nr_devs;
+};
+
+struct scull_ckpt_dev {
+	__le64	quantum;	/* own geometry of the device, 0 for defaults */
+	__le64	qset;
+	__le64	quantum_len;	/* of the store, and of the quanta below */
+	__le64	qset_len;
+	__le64	len;
+	__le64	flags;
+};
+
+struct scull_ckpt_run {
+	__le64	first;		/* quantum number */
+	__le64	nr;		/* quanta that follow */
+};
+
+struct scull_ckpt {
+	struct	file		*file;
+	loff_t	pos;
+	struct	scull_ckpt_run	 run;
+	struct	kvec		 vec[SCULL_CKPT_RUN + 1];	/* run first */
+	void	*quanta[SCULL_CKPT_RUN];
+};
+
+static int scull_ckpt_write(struct scull_ckpt *ck, size_t nr, size_t len)
+{
+	struct	iov_iter	iter;
+	ssize_t	n;
+
+	iov_iter_kvec(&iter, WRITE, ck->vec, nr, len);
+	file_start_write(ck->file);
+	n = vfs_iter_write(ck->file, &iter, &ck->pos, 0);
+	file_end_write(ck->file);
+	if (n < 0)
+		return (n);
+	return ((size_t)n == len ? 0 : -ENOSPC);
+}
+
+/* a short read is a truncated image */
+static int scull_ckpt_read(struct scull_ckpt *ck, size_t nr, size_t len)
+{
+	struct	iov_iter	iter;
+	ssize_t	n;
+
+	iov_iter_kvec(&iter, READ, ck->vec, nr, len);
+	n = vfs_iter_read(ck->file, &iter, &ck->pos, 0);
+	if (n < 0)
+		return (n);
+	return ((size_t)n == len ? 0 : -EIO);
+}
+
+static int scull_ckpt_put(struct scull_ckpt *ck, void *buf, size_t len)
+{
+
+	ck->vec[0].iov_base = buf;
+	ck->vec[0].iov_len = len;
+	return (scull_ckpt_write(ck, 1, len));
+}
+
+static int scull_ckpt_get(struct scull_ckpt *ck, void *buf, size_t len)
+{
+
+	ck->vec[0].iov_base = buf;
+	ck->vec[0].iov_len = len;
+	return (scull_ckpt_read(ck, 1, len));
+}
+
+/*
+ * the nr quanta gathered in ck->vec from first on, behind their run
+ */
+static int scull_ckpt_flush(struct scull_ckpt *ck, size_t quantum_len,
+		unsigned long first, size_t nr)
+{
+
+	ck->run.first = cpu_to_le64(first);
+	ck->run.nr = cpu_to_le64(nr);
+	ck->vec[0].iov_base = &ck->run;
+	ck->vec[0].iov_len = sizeof(ck->run);
+	return (scull_ckpt_write(ck, nr + 1,
+			sizeof(ck->run) + nr * quantum_len));
+}
+
+/*
+ * the quanta of snap up to its length, which nobody else can reach
+ */
+static int scull_ckpt_runs(struct scull_ckpt *ck, struct scull_store *snap)
+{
+	struct	scull_qset	*qset;
+	unsigned long	idx, q, first = 0;
+	void	*quantum;
+	size_t	i, nr = 0;
+	int	ret;
+
+	xa_for_each(&snap->qsets, idx, qset) {
+		for (i = 0; i < snap->qset_len; i++) {
+			quantum = rcu_dereference_protected(qset->data[i], 1);
+			q = idx * snap->qset_len + i;
+			if (quantum == NULL ||
+			    (loff_t)q * snap->quantum_len >= (loff_t)snap->len)
+				continue;
+			if (nr == SCULL_CKPT_RUN ||
+			    (nr != 0 && q != first + nr)) {
+				ret = scull_ckpt_flush(ck, snap->quantum_len,
+						first, nr);
+				if (ret)
+					return (ret);
+				nr = 0;
+			}
+			if (nr == 0)
+				first = q;
+			ck->vec[++nr].iov_base = quantum;
+			ck->vec[nr].iov_len = snap->quantum_len;
+		}
+		if (fatal_signal_pending(current))
+			return (-EINTR);
+		cond_resched();
+	}
+	if (nr != 0) {
+		ret = scull_ckpt_flush(ck, snap->quantum_len, first, nr);
+		if (ret)
+			return (ret);
+	}
+	return (scull_ckpt_flush(ck, snap->quantum_len, 0, 0));
+}
+
+static int scull_ckpt_dev(struct scull_ckpt *ck, struct scull_dev *dev)
+{
+	struct	scull_ckpt_dev	 hdr;
+	struct	scull_store	*snap;
+	int	ret;
+
+	if (dev->dax != NULL) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.flags = cpu_to_le64(SCULL_CKPT_DAX);
+		ret = scull_ckpt_put(ck, &hdr, sizeof(hdr));
+		if (ret == 0)
+			ret = scull_ckpt_flush(ck, 0, 0, 0);
+		return (ret);
+	}
+	snap = scull_snapshot_take(dev, dev);
+	if (IS_ERR(snap))
+		return (PTR_ERR(snap));
+	hdr.quantum = cpu_to_le64(READ_ONCE(dev->quantum));
+	hdr.qset = cpu_to_le64(READ_ONCE(dev->qset));
+	hdr.quantum_len = cpu_to_le64(snap->quantum_len);
+	hdr.qset_len = cpu_to_le64(snap->qset_len);
+	hdr.len = cpu_to_le64(snap->len);
+	hdr.flags = cpu_to_le64(snap->compact ? SCULL_CKPT_COMPACT : 0);
+	ret = scull_ckpt_put(ck, &hdr, sizeof(hdr));
+	if (ret == 0)
+		ret = scull_ckpt_runs(ck, snap);
+	scull_snapshot_drop(dev, snap);
+	return (ret);
+}
+
+/*
+ * SCULL_IOCTCHECKPOINT: all devices, one after the other, from the start
+ * of file, which ends with them; a page backed device that is mapped
+ * fails it with EBUSY
+ */
+long scull_checkpoint(struct file *file)
+{
+	struct	scull_ckpt_hdr	 hdr;
+	struct	scull_ckpt	*ck;
+	size_t	i;
+	int	ret;
+
+	ck = kmalloc(sizeof(*ck), GFP_KERNEL);
+	if (ck == NULL)
+		return (-ENOMEM);
+	ck->file = file;
+	ck->pos = 0;
+	hdr.magic = cpu_to_le32(SCULL_CKPT_MAGIC);
+	hdr.version = cpu_to_le32(SCULL_CKPT_VERSION);
+	hdr.nr_devs = cpu_to_le64(scull_nr_devs);
+	ret = scull_ckpt_put(ck, &hdr, sizeof(hdr));
+	for (i = 0; i < scull_nr_devs && ret == 0; i++)
+		ret = scull_ckpt_dev(ck, &scull_devices[i]);
+	/* nothing of an older, longer image is left behind */
+	if (ret == 0 && i_size_read(file_inode(file)) > ck->pos)
+		ret = vfs_truncate(&file->f_path, ck->pos);
+	kfree(ck);
+	return (ret);
+}
+
+/*
+ * read the nr quanta of a run into store, which is not published yet
+ */
+static int scull_ckpt_load_run(struct scull_ckpt *ck,
+		struct scull_store *store, unsigned long first, size_t nr)
+{
+	struct	scull_qset	*qset;
+	unsigned long	q;
+	size_t	i, n;
+	int	ret;
+
+	n = scull_quantum_alloc_bulk(store, GFP_KERNEL, nr, ck->quanta);
+	if (n < nr) {
+		/* one by one, the store keeps counting */
+		while (n != 0)
+			scull_quantum_free(store, ck->quanta[--n]);
+		return (-ENOMEM);
+	}
+	for (i = 0; i < nr; i++) {
+		ck->vec[i].iov_base = ck->quanta[i];
+		ck->vec[i].iov_len = store->quantum_len;
+	}
+	ret = scull_ckpt_read(ck, nr, nr * store->quantum_len);
+
+	for (i = 0; i < nr && ret == 0; i++) {
+		q = first + i;
+		qset = xa_load(&store->qsets, q / store->qset_len);
+		if (qset == NULL)
+			qset = __scull_qset_alloc(store, q / store->qset_len);
+		if (qset == NULL) {
+			ret = -ENOMEM;
+		} else if (rcu_access_pointer(
+		    qset->data[q % store->qset_len]) != NULL) {
+			/* runs overlap */
+			ret = -EINVAL;
+		} else {
+			RCU_INIT_POINTER(qset->data[q % store->qset_len],
+					ck->quanta[i]);
+			ck->quanta[i] = NULL;
+		}
+	}
+	/* those not in a slot yet */
+	for (i = 0; i < nr && ret != 0; i++)
+		scull_quantum_free(store, ck->quanta[i]);
+	return (ret);
+}
+
+/*
+ * past the runs of a device that is not restored
+ */
+static int scull_ckpt_skip(struct scull_ckpt *ck, size_t quantum_len)
+{
+	u64	nr;
+	int	ret;
+
+	for (;;) {
+		ret = scull_ckpt_get(ck, &ck->run, sizeof(ck->run));
+		if (ret)
+			return (ret);
+		nr = le64_to_cpu(ck->run.nr);
+		if (nr == 0)
+			return (0);
+		if (nr > SCULL_CKPT_RUN || quantum_len == 0)
+			return (-EINVAL);
+		ck->pos += nr * quantum_len;
+	}
+}
+
+static int scull_ckpt_load_dev(struct scull_ckpt *ck, struct scull_dev *dev)
+{
+	struct	scull_ckpt_dev	 hdr;
+	struct	scull_store	*store;
+	size_t	quantum, qset, quantum_len, qset_len, nr;
+	unsigned long	first;
+	int	ret;
+
+	ret = scull_ckpt_get(ck, &hdr, sizeof(hdr));
+	if (ret)
+		return (ret);
+	quantum = le64_to_cpu(hdr.quantum);
+	qset = le64_to_cpu(hdr.qset);
+	quantum_len = le64_to_cpu(hdr.quantum_len);
+	qset_len = le64_to_cpu(hdr.qset_len);
+	if (quantum != le64_to_cpu(hdr.quantum) ||
+	    qset != le64_to_cpu(hdr.qset) ||
+	    quantum_len != le64_to_cpu(hdr.quantum_len) ||
+	    qset_len != le64_to_cpu(hdr.qset_len) ||
+	    le64_to_cpu(hdr.len) > MAX_LFS_FILESIZE)
+		return (-EINVAL);
+	/* a device backed by persistent memory keeps what it holds */
+	if (dev->dax != NULL || (le64_to_cpu(hdr.flags) & SCULL_CKPT_DAX))
+		return (scull_ckpt_skip(ck, quantum_len));
+
+	store = scull_store_alloc(dev);
+	if (store == NULL)
+		return (-ENOMEM);
+	/*
+	 * the own geometry of the device must still be valid, the store
+	 * keeps the one of its quanta; scull_pages may have changed the
+	 * quantum size since
+	 */
+	ret = __scull_store_layout(store, quantum ? quantum : scull_quantum,
+			qset ? qset : scull_qset);
+	if (ret == 0)
+		ret = __scull_store_layout(store, quantum_len, qset_len);
+	if (ret == 0 && store->quantum_len != quantum_len)
+		ret = -EINVAL;
+	if (ret)
+		goto fail;
+	store->compact = le64_to_cpu(hdr.flags) & SCULL_CKPT_COMPACT;
+
+	for (;;) {
+		ret = scull_ckpt_get(ck, &ck->run, sizeof(ck->run));
+		if (ret)
+			goto fail;
+		first = le64_to_cpu(ck->run.first);
+		nr = le64_to_cpu(ck->run.nr);
+		if (nr == 0)
+			break;
+		if (nr > SCULL_CKPT_RUN ||
+		    first != le64_to_cpu(ck->run.first) ||
+		    first > MAX_LFS_FILESIZE / quantum_len - nr) {
+			ret = -EINVAL;
+			goto fail;
+		}
+		ret = scull_ckpt_load_run(ck, store, first, nr);
+		if (ret)
+			goto fail;
+		cond_resched();
+	}
+	store->len = le64_to_cpu(hdr.len);
+
+	__down_write_sparse(&dev->lock);
+	dev->quantum = quantum;
+	dev->qset = qset;
+	__scull_store_replace(dev, store);
+	__up_write_sparse(&dev->lock);
+	return (0);
+fail:
+	scull_store_free(store);
+	return (ret);
+}
+
+/*
+ * at load time, once the devices are set up; a device the image cannot
+ * be read for and those after it stay empty, the module loads anyway
+ */
+void scull_ckpt_restore(void)
+{
+	struct	scull_ckpt_hdr	 hdr;
+	struct	scull_ckpt	*ck;
+	struct	file		*file;
+	size_t	i, nr_devs;
+	int	ret;
+
+	if (scull_restore == NULL || *scull_restore == '\0')
+		return;
+	file = filp_open(scull_restore, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(file)) {
+		pr_warn("scull: can't open %s: %ld\n", scull_restore,
+				PTR_ERR(file));
+		return;
+	}
+	i = 0;
+	ck = kmalloc(sizeof(*ck), GFP_KERNEL);
+	if (ck == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ck->file = file;
+	ck->pos = 0;
+	/* the whole file, front to back: let readahead run far ahead */
+	vfs_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ret = scull_ckpt_get(ck, &hdr, sizeof(hdr));
+	if (ret == 0 && (le32_to_cpu(hdr.magic) != SCULL_CKPT_MAGIC ||
+	    le32_to_cpu(hdr.version) != SCULL_CKPT_VERSION))
+		ret = -EINVAL;
+	if (ret == 0) {
+		/* devices the image has no room for stay empty */
+		nr_devs = min_t(u64, le64_to_cpu(hdr.nr_devs), scull_nr_devs);
+		for (i = 0; i < nr_devs; i++) {
+			ret = scull_ckpt_load_dev(ck, &scull_devices[i]);
+			if (ret)
+				break;
+		}
+	}
+	kfree(ck);
+out:
+	if (ret)
+		pr_warn("scull: %s: device %zu not restored: %d\n",
+				scull_restore, i, ret);
+	else
+		pr_debug("restored %zu devices from %s\n", i, scull_restore);
+	filp_close(file, NULL);
+}
@@ -0,0 +1,318 @@
+#include <linux/crypto.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "mutex_sparse.h"
+#include "rwsem_sparse.h"
+#include "scull.h"
+
+/*
+ * qsets of slab backed devices left alone for scull_cold seconds have
+ * their quanta compressed by a background scan; a quantum is decompressed
+ * again, in place, on its next access. Page backed devices are skipped,
+ * their quanta may be mapped.
+ */
+
+/* crypto API compressor ("lz4", "zstd", ...), none by default */
+static char *scull_compress;
+module_param(scull_compress, charp, S_IRUGO);
+
+static uint scull_cold = 60;
+module_param(scull_cold, uint, S_IRUGO);
+
+bool scull_compressing;
+
+struct scull_zquantum {
+	unsigned int	len;
+	u8		data[];
+};
+
+/* decompression happens on the read path, one transform per cpu */
+static struct crypto_comp * __percpu *scull_ztfms;
+
+/* compression only happens in scull_zwork */
+static struct crypto_comp *scull_ztfm;
+static u8	*scull_zbuf;
+static size_t	 scull_zbuf_len;
+static bool	 scull_zurgent;
+
+static void scull_zscan(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scull_zwork, scull_zscan);
+
+static struct scull_zquantum *scull_zq(void *zquantum)
+{
+
+	return ((void *)((unsigned long)zquantum & ~SCULL_ZTAG));
+}
+
+void scull_zquantum_unaccount(struct scull_store *store, void *zquantum)
+{
+
+	atomic_long_dec(&store->stats.zquanta);
+	atomic_long_sub(scull_zq(zquantum)->len, &store->stats.zbytes);
+}
+
+void scull_zquantum_free(void *zquantum)
+{
+
+	kfree(scull_zq(zquantum));
+}
+
+/*
+ * the contents of a compressed quantum of store, into quantum
+ */
+int scull_zquantum_read(struct scull_store *store, void *zquantum,
+		void *quantum)
+{
+	struct	scull_zquantum	*zq = scull_zq(zquantum);
+	struct	crypto_comp	*tfm;
+	unsigned int	dlen = store->quantum_len;
+	int	ret;
+
+	tfm = *get_cpu_ptr(scull_ztfms);
+	ret = crypto_comp_decompress(tfm, zq->data, zq->len, quantum, &dlen);
+	put_cpu_ptr(scull_ztfms);
+	return (ret ? -EIO : 0);
+}
+
+/*
+ * decompress the quantum of a slot into a new quantum and put it in its
+ * place, readers racing for it share the winner's; the compressed copy is
+ * retired as other readers may still decompress it.
+ *
+ * returns what the slot holds now, an ERR_PTR on failure
+ */
+void *scull_quantum_inflate(struct scull_store *store, void __rcu **slot,
+		void *zquantum)
+{
+	struct	scull_retire	*retire;
+	void	*quantum, *old;
+	int	ret;
+
+	quantum = scull_quantum_alloc(store, GFP_KERNEL);
+	retire = scull_retire_alloc(store, 1);
+	if (quantum == NULL || retire == NULL) {
+		scull_quantum_free(store, quantum);
+		kfree(retire);
+		return (ERR_PTR(-ENOMEM));
+	}
+
+	ret = scull_zquantum_read(store, zquantum, quantum);
+	if (ret) {
+		scull_quantum_free(store, quantum);
+		kfree(retire);
+		return (ERR_PTR(ret));
+	}
+
+	old = cmpxchg((void __force **)slot, zquantum, quantum);
+	if (old == zquantum) {
+		scull_retire_add(retire, store, zquantum);
+		old = quantum;
+	} else {
+		scull_quantum_free(store, quantum);
+	}
+	scull_retire(retire);
+	return (old);
+}
+
+/*
+ * a tagged compressed copy of quantum, NULL unless it saves a quarter
+ */
+static void *scull_zquantum_deflate(struct scull_store *store, void *quantum)
+{
+	struct	scull_zquantum	*zq;
+	unsigned int	dlen = store->quantum_len - store->quantum_len / 4;
+
+	if (scull_zbuf_len < dlen) {
+		kvfree(scull_zbuf);
+		scull_zbuf_len = 0;
+		scull_zbuf = kvmalloc(dlen, GFP_KERNEL);
+		if (scull_zbuf == NULL)
+			return (NULL);
+		scull_zbuf_len = dlen;
+	}
+	/* fails when the output does not fit */
+	if (crypto_comp_compress(scull_ztfm, quantum, store->quantum_len,
+	    scull_zbuf, &dlen))
+		return (NULL);
+
+	zq = kmalloc(struct_size(zq, data, dlen), GFP_KERNEL | __GFP_NOWARN);
+	if (zq == NULL)
+		return (NULL);
+	zq->len = dlen;
+	memcpy(zq->data, scull_zbuf, dlen);
+	atomic_long_inc(&store->stats.zquanta);
+	atomic_long_add(dlen, &store->stats.zbytes);
+	return ((void *)((unsigned long)zq | SCULL_ZTAG));
+}
+
+static void scull_zqset(struct scull_store *store, struct scull_qset *qset)
+{
+	struct	scull_retire	*retire;
+	void	*quantum, *zquantum;
+	size_t	i;
+
+	retire = scull_retire_alloc(store, store->qset_len);
+	if (retire == NULL)
+		return;
+
+	__mutex_lock_sparse(&qset->lock);
+	for (i = 0; i < store->qset_len; i++) {
+		quantum = rcu_dereference_protected(qset->data[i],
+				lockdep_is_held(&qset->lock));
+		/* shared quanta would only be duplicated */
+		if (quantum == NULL || scull_slot_tagged(quantum) ||
+		    scull_quantum_shared(quantum))
+			continue;
+		zquantum = scull_zquantum_deflate(store, quantum);
+		if (zquantum == NULL)
+			continue;
+		/* writers are locked out, readers only replace tagged slots */
+		rcu_assign_pointer(qset->data[i], zquantum);
+		scull_retire_add(retire, store, quantum);
+	}
+	/* what did not compress waits for another period */
+	WRITE_ONCE(qset->atime, jiffies);
+	__mutex_unlock_sparse(&qset->lock);
+	scull_retire(retire);
+}
+
+/*
+ * writers hold dev->lock for reading, so do we: a snapshot or a repack
+ * does not see slots change under it
+ */
+static void scull_zscan_dev(struct scull_dev *dev, bool urgent)
+{
+	const	unsigned long	cold = jiffies - scull_cold * HZ;
+	struct	scull_store	*store;
+	struct	scull_qset	*qset;
+	unsigned long	idx;
+
+	if (__down_read_killable_sparse(&dev->lock))
+		return;
+	store = scull_store_locked(dev);
+	if (scull_store_slab(store)) {
+		xa_for_each(&store->qsets, idx, qset) {
+			if (urgent || time_before(READ_ONCE(qset->atime), cold))
+				scull_zqset(store, qset);
+			cond_resched();
+		}
+	}
+	__up_read_sparse(&dev->lock);
+}
+
+static void scull_zscan(struct work_struct *work)
+{
+	const	bool	urgent = READ_ONCE(scull_zurgent);
+	size_t	i;
+
+	WRITE_ONCE(scull_zurgent, false);
+	for (i = 0; i < scull_nr_devs; i++)
+		scull_zscan_dev(&scull_devices[i], urgent);
+	queue_delayed_work(scull_wq, &scull_zwork,
+			(scull_cold * HZ) / 2 + 1);
+}
+
+/*
+ * under memory pressure the scan runs at once, on every qset
+ */
+static unsigned long scull_zcount(struct shrinker *shrinker,
+		struct shrink_control *sc)
+{
+	struct	scull_store	*store;
+	unsigned long	count = 0;
+	size_t	i;
+	int	idx;
+
+	idx = srcu_read_lock(&scull_srcu);
+	for (i = 0; i < scull_nr_devs; i++) {
+		store = srcu_dereference(scull_devices[i].store, &scull_srcu);
+		if (scull_store_slab(store))
+			count += atomic_long_read(&store->stats.quanta);
+	}
+	srcu_read_unlock(&scull_srcu, idx);
+	return (count ? count : SHRINK_EMPTY);
+}
+
+static unsigned long scull_zshrink(struct shrinker *shrinker,
+		struct shrink_control *sc)
+{
+
+	/* compressing allocates, not from reclaim */
+	WRITE_ONCE(scull_zurgent, true);
+	mod_delayed_work(scull_wq, &scull_zwork, 0);
+	return (SHRINK_STOP);
+}
+
+static struct shrinker scull_zshrinker = {
+	.count_objects =	scull_zcount,
+	.scan_objects =		scull_zshrink,
+	.seeks =		DEFAULT_SEEKS,
+};
+
+int scull_compress_init(void)
+{
+	struct	crypto_comp	*tfm;
+	int	cpu, ret;
+
+	if (scull_compress == NULL || *scull_compress == '\0')
+		return (0);
+
+	scull_ztfm = crypto_alloc_comp(scull_compress, 0, 0);
+	if (IS_ERR(scull_ztfm)) {
+		ret = PTR_ERR(scull_ztfm);
+		scull_ztfm = NULL;
+		pr_warn("scull: no compressor %s\n", scull_compress);
+		return (ret);
+	}
+	scull_ztfms = alloc_percpu(struct crypto_comp *);
+	if (scull_ztfms == NULL)
+		goto fail;
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(scull_compress, 0, 0);
+		if (IS_ERR(tfm))
+			goto fail;
+		*per_cpu_ptr(scull_ztfms, cpu) = tfm;
+	}
+	ret = register_shrinker(&scull_zshrinker);
+	if (ret)
+		goto fail;
+
+	scull_compressing = true;
+	queue_delayed_work(scull_wq, &scull_zwork, scull_cold * HZ + 1);
+	return (0);
+fail:
+	scull_compress_cleanup();
+	return (-ENOMEM);
+}
+
+/*
+ * compressed quanta stay compressed, the stores free them with kfree()
+ */
+void scull_compress_cleanup(void)
+{
+	int cpu;
+
+	if (scull_compressing) {
+		unregister_shrinker(&scull_zshrinker);
+		cancel_delayed_work_sync(&scull_zwork);
+		scull_compressing = false;
+	}
+	if (scull_ztfms != NULL) {
+		for_each_possible_cpu(cpu)
+			if (!IS_ERR_OR_NULL(*per_cpu_ptr(scull_ztfms, cpu)))
+				crypto_free_comp(*per_cpu_ptr(scull_ztfms,
+						cpu));
+		free_percpu(scull_ztfms);
+		scull_ztfms = NULL;
+	}
+	if (scull_ztfm != NULL)
+		crypto_free_comp(scull_ztfm);
+	scull_ztfm = NULL;
+	kvfree(scull_zbuf);
+	scull_zbuf = NULL;
+	scull_zbuf_len = 0;
+}
@@ -0,0 +1,385 @@
+#include <linux/blkdev.h>
+#include <linux/bitops.h>
+#include <linux/dax.h>
+#include <linux/libnvdimm.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/pfn_t.h>
+#include <linux/uio.h>
+
+#include "rwsem_sparse.h"
+#include "scull.h"
+
+/*
+ * with scull_dax=<pmem block device>, scull0 keeps its quanta in the
+ * persistent memory of the device, reached through DAX, instead of slab
+ * or pages: emulated pmem (memmap=) will do. The contents are there again
+ * on the next load, without a restore.
+ *
+ * The region is laid out as a header page, a bitmap of the frames that
+ * hold a quantum, then the frames, quantum n of the device in frame n.
+ * Only the index (qsets and slots) lives in memory, rebuilt from the
+ * bitmap at load. Frames are zeroed when taken and written back to the
+ * region before their bit is set. Data goes to the persistence domain as
+ * it is copied in, ahead of the length that covers it.
+ *
+ * Such a device is neither compressed, spilled, deduplicated, nor
+ * snapshotted or repacked: its quanta never leave their frame. Readers
+ * racing a trim or a hole punch may see the frame taken again.
+ */
+static char *scull_dax;
+module_param(scull_dax, charp, S_IRUGO);
+
+#define SCULL_DAX_MAGIC		0x58414453	/* "SDAX" */
+#define SCULL_DAX_VERSION	1
+
+struct scull_dax_super {
+	__le32	magic;
+	__le32	version;
+	__le64	quantum;	/* size of a frame */
+	__le64	nr;		/* frames */
+	__le64	len;		/* of the device */
+};
+
+struct scull_dax {
+	struct	block_device	*bdev;
+	struct	dax_device	*dax_dev;
+	struct	scull_dax_super	*super;	/* start of the region */
+	unsigned long	*map;		/* little endian bitmap */
+	void	*frames;
+	size_t	quantum;
+	size_t	nr;
+};
+
+static struct scull_dax scull_dax_region;
+
+#define SCULL_DAX_MODE	(FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+/* the persistence fence, where the architecture does not have its own */
+#ifndef pmem_wmb
+#define pmem_wmb()	wmb()
+#endif
+
+/* to the persistence domain, in order with what follows */
+static void scull_dax_persist(void *addr, size_t size)
+{
+
+	arch_wb_cache_pmem(addr, size);
+	pmem_wmb();
+}
+
+static size_t scull_dax_map_bytes(size_t nr)
+{
+
+	return (round_up(BITS_TO_LONGS(nr) * sizeof(long), PAGE_SIZE));
+}
+
+static void *scull_dax_frame(struct scull_dax *dax, unsigned long n)
+{
+
+	return (dax->frames + n * dax->quantum);
+}
+
+/*
+ * bytes a device backed by dax can hold
+ */
+loff_t scull_dax_size(const struct scull_dax *dax)
+{
+
+	return ((loff_t)dax->nr * dax->quantum);
+}
+
+/*
+ * geometry of a store of the device: the quantum is that of the frames,
+ * the qset size only shapes the index
+ */
+int scull_dax_layout(struct scull_dax *dax, struct scull_store *store,
+		size_t qset)
+{
+
+	if (qset == 0 || qset > KMALLOC_MAX_SIZE / sizeof(void *))
+		return (-EINVAL);
+	store->pages = false;
+	store->cache = NULL;
+	store->quantum_len = dax->quantum;
+	store->qset_len = qset;
+	store->compact = false;
+	store->dax = dax;
+	return (0);
+}
+
+/*
+ * the frame of quantum number n, zeroed, now part of the device; NULL
+ * past the end of the region. Called with the qset lock held; a frame
+ * that is part of the device already is handed back as it is, see
+ * __scull_quantum_install()
+ */
+void *scull_dax_claim(struct scull_dax *dax, unsigned long n)
+{
+	void *frame;
+
+	if (n >= dax->nr)
+		return (NULL);
+	frame = scull_dax_frame(dax, n);
+	if (test_bit_le(n, dax->map))
+		return (frame);
+	/* what a trim or a hole left behind */
+	memset(frame, 0, dax->quantum);
+	scull_dax_persist(frame, dax->quantum);
+	set_bit_le(n, dax->map);
+	scull_dax_persist(&dax->map[BIT_WORD(n)], sizeof(long));
+	return (frame);
+}
+
+/*
+ * the frame is a hole from now on
+ */
+void scull_dax_unclaim(struct scull_dax *dax, void *frame)
+{
+	const unsigned long n = (frame - dax->frames) / dax->quantum;
+
+	clear_bit_le(n, dax->map);
+	scull_dax_persist(&dax->map[BIT_WORD(n)], sizeof(long));
+}
+
+/*
+ * write into a frame, bypassing or flushing the cache; persistent after
+ * the next scull_dax_flush()
+ */
+size_t scull_dax_copy(void *addr, size_t size, struct iov_iter *from)
+{
+	size_t n;
+
+	n = copy_from_iter_flushcache(addr, size, from);
+	if (!IS_ENABLED(CONFIG_ARCH_HAS_UACCESS_FLUSHCACHE))
+		arch_wb_cache_pmem(addr, n);
+	return (n);
+}
+
+void scull_dax_zero(void *addr, size_t size)
+{
+
+	memset(addr, 0, size);
+	arch_wb_cache_pmem(addr, size);
+}
+
+/*
+ * what was copied or zeroed so far reaches the persistence domain
+ */
+void scull_dax_flush(struct scull_dax *dax)
+{
+
+	pmem_wmb();
+}
+
+/*
+ * called with the length of the device, under the xarray lock; what was
+ * copied below it is persistent first
+ */
+void scull_dax_set_len(struct scull_dax *dax, size_t len)
+{
+
+	scull_dax_flush(dax);
+	dax->super->len = cpu_to_le64(len);
+	scull_dax_persist(&dax->super->len, sizeof(dax->super->len));
+}
+
+/*
+ * after a trim, the trimmed store keeps its frames until it is freed
+ * but they are no longer part of the device
+ */
+void scull_dax_clear(struct scull_dax *dax)
+{
+
+	memset(dax->map, 0, scull_dax_map_bytes(dax->nr));
+	scull_dax_persist(dax->map, scull_dax_map_bytes(dax->nr));
+	scull_dax_set_len(dax, 0);
+}
+
+/*
+ * the frames a region of size bytes has room for, behind the header and
+ * the bitmap
+ */
+static size_t scull_dax_frames(size_t size, size_t quantum)
+{
+	size_t nr;
+
+	if (size <= PAGE_SIZE || quantum == 0)
+		return (0);
+	/* a bit of the map for each frame, then the page rounding */
+	nr = div64_u64((u64)(size - PAGE_SIZE) * BITS_PER_BYTE,
+			(u64)quantum * BITS_PER_BYTE + 1);
+	while (nr != 0 &&
+	    PAGE_SIZE + scull_dax_map_bytes(nr) + nr * quantum > size)
+		nr--;
+	return (nr);
+}
+
+/*
+ * a region without the magic is formatted with the quantum of the
+ * module; one with it must fit the device
+ */
+static int scull_dax_format(struct scull_dax *dax, size_t size)
+{
+	struct	scull_dax_super	*sb = dax->super;
+	u64	quantum, nr;
+
+	if (le32_to_cpu(sb->magic) != SCULL_DAX_MAGIC) {
+		dax->quantum = scull_quantum;
+		dax->nr = scull_dax_frames(size, dax->quantum);
+		if (dax->quantum == 0 || dax->nr == 0)
+			return (-EINVAL);
+		pr_notice("scull: formatting %s, %zu quanta of %zu bytes\n",
+				scull_dax, dax->nr, dax->quantum);
+		memset((void *)sb + PAGE_SIZE, 0, scull_dax_map_bytes(dax->nr));
+		scull_dax_persist((void *)sb + PAGE_SIZE,
+				scull_dax_map_bytes(dax->nr));
+		sb->version = cpu_to_le32(SCULL_DAX_VERSION);
+		sb->quantum = cpu_to_le64(dax->quantum);
+		sb->nr = cpu_to_le64(dax->nr);
+		sb->len = 0;
+		scull_dax_persist(sb, sizeof(*sb));
+		/* the header is valid once the rest is */
+		sb->magic = cpu_to_le32(SCULL_DAX_MAGIC);
+		scull_dax_persist(&sb->magic, sizeof(sb->magic));
+	}
+
+	/* checked as found, before they are used */
+	quantum = le64_to_cpu(sb->quantum);
+	nr = le64_to_cpu(sb->nr);
+	if (le32_to_cpu(sb->version) != SCULL_DAX_VERSION ||
+	    quantum == 0 || quantum > size - PAGE_SIZE ||
+	    nr == 0 || nr > scull_dax_frames(size, quantum) ||
+	    le64_to_cpu(sb->len) > nr * quantum)
+		return (-EINVAL);
+	dax->quantum = quantum;
+	dax->nr = nr;
+	dax->map = (void *)sb + PAGE_SIZE;
+	dax->frames = (void *)dax->map + scull_dax_map_bytes(dax->nr);
+	return (0);
+}
+
+/*
+ * the whole device mapped at once, for as long as the module holds it
+ * open, like dm-writecache does
+ */
+static int scull_dax_open(struct scull_dax *dax)
+{
+	size_t	size;
+	pgoff_t	pgoff;
+	pfn_t	pfn;
+	void	*kaddr;
+	long	nr_pages;
+	int	id, ret;
+
+	if (!IS_ENABLED(CONFIG_FS_DAX))
+		return (-EOPNOTSUPP);
+	dax->bdev = blkdev_get_by_path(scull_dax, SCULL_DAX_MODE, dax);
+	if (IS_ERR(dax->bdev)) {
+		ret = PTR_ERR(dax->bdev);
+		dax->bdev = NULL;
+		return (ret);
+	}
+	dax->dax_dev = fs_dax_get_by_bdev(dax->bdev);
+	if (dax->dax_dev == NULL)
+		return (-EOPNOTSUPP);
+
+	size = round_down(i_size_read(dax->bdev->bd_inode), PAGE_SIZE);
+	ret = bdev_dax_pgoff(dax->bdev, 0, size, &pgoff);
+	if (ret)
+		return (ret);
+	id = dax_read_lock();
+	nr_pages = dax_direct_access(dax->dax_dev, pgoff, size >> PAGE_SHIFT,
+			&kaddr, &pfn);
+	dax_read_unlock(id);
+	if (nr_pages < 0)
+		return (nr_pages);
+	/* what is directly addressable in one piece */
+	size = min_t(size_t, size, (size_t)nr_pages << PAGE_SHIFT);
+	dax->super = kaddr;
+	return (scull_dax_format(dax, size));
+}
+
+static void scull_dax_close(struct scull_dax *dax)
+{
+
+	if (dax->dax_dev != NULL)
+		put_dax(dax->dax_dev);
+	if (dax->bdev != NULL)
+		blkdev_put(dax->bdev, SCULL_DAX_MODE);
+	memset(dax, 0, sizeof(*dax));
+}
+
+/*
+ * the index of the frames in use, into store, which nobody can reach yet
+ */
+static int scull_dax_load(struct scull_dax *dax, struct scull_store *store)
+{
+	struct	scull_qset	*qset;
+	unsigned long	n;
+	void	*frame;
+
+	for (n = find_next_bit_le(dax->map, dax->nr, 0); n < dax->nr;
+	    n = find_next_bit_le(dax->map, dax->nr, n + 1)) {
+		qset = xa_load(&store->qsets, n / store->qset_len);
+		if (qset == NULL)
+			qset = __scull_qset_alloc(store, n / store->qset_len);
+		if (qset == NULL)
+			return (-ENOMEM);
+		frame = scull_dax_frame(dax, n);
+		RCU_INIT_POINTER(qset->data[n % store->qset_len], frame);
+		scull_quantum_account(store, frame, 1);
+		cond_resched();
+	}
+	store->len = le64_to_cpu(dax->super->len);
+	return (0);
+}
+
+/*
+ * after the devices are set up, before they are live: scull0 gets the
+ * region and what it holds. Like a restore that fails, a region that
+ * can't be used leaves scull0 in memory, the module loads anyway
+ */
+void scull_dax_init(void)
+{
+	struct	scull_dax	*dax = &scull_dax_region;
+	struct	scull_dev	*dev = &scull_devices[0];
+	struct	scull_store	*store;
+	int	ret;
+
+	if (scull_dax == NULL || *scull_dax == '\0')
+		return;
+	ret = scull_dax_open(dax);
+	if (ret) {
+		pr_warn("scull: can't use %s: %d\n", scull_dax, ret);
+		scull_dax_close(dax);
+		return;
+	}
+
+	__down_write_sparse(&dev->lock);
+	dev->dax = dax;
+	store = scull_store_alloc(dev);
+	ret = store == NULL ? -ENOMEM : scull_dax_load(dax, store);
+	if (ret == 0) {
+		__scull_store_replace(dev, store);
+	} else {
+		dev->dax = NULL;
+		scull_store_free(store);
+	}
+	__up_write_sparse(&dev->lock);
+	if (ret) {
+		pr_warn("scull: can't load %s: %d\n", scull_dax, ret);
+		scull_dax_close(dax);
+	}
+}
+
+/*
+ * once the stores are gone; the data is in the region already
+ */
+void scull_dax_cleanup(void)
+{
+	struct scull_dax *dax = &scull_dax_region;
+
+	scull_dax_flush(dax);
+	scull_dax_close(dax);
+}
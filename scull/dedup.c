@@ -0,0 +1,198 @@
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/xxhash.h>
+
+#include "mutex_sparse.h"
+#include "scull.h"
+
+/*
+ * quanta written as a whole on slab backed devices: all zeroes become a
+ * hole, and with scull_dedup a quantum equal to another quantum of the
+ * same device is shared with it. Shared quanta are copied on write like
+ * those of a snapshot. Page backed devices are left alone, a mapping
+ * could change a shared page under us.
+ */
+static bool scull_dedup;
+module_param(scull_dedup, bool, S_IRUGO);
+
+/* entries of the per store table of recently written quanta */
+#ifndef SCULL_DEDUP_SLOTS
+#define SCULL_DEDUP_SLOTS	4096
+#endif
+
+/*
+ * direct mapped by hash and lossy: an entry only says where a quantum
+ * with that hash was written. Writers of different qsets update it
+ * concurrently, every hit is checked under the lock of its qset
+ */
+struct scull_dedup {
+	struct {
+		unsigned long	hash;
+		unsigned long	where;	/* quantum number + 1, 0 if empty */
+	} slots[SCULL_DEDUP_SLOTS];
+};
+
+static struct scull_dedup *scull_dedup_table(struct scull_store *store)
+{
+	struct scull_dedup *table, *old;
+
+	table = READ_ONCE(store->dedup);
+	if (table != NULL)
+		return (table);
+	table = kvzalloc(sizeof(*table), GFP_KERNEL);
+	if (table == NULL)
+		return (NULL);
+	old = cmpxchg(&store->dedup, NULL, table);
+	if (old == NULL)
+		return (table);
+	kvfree(table);
+	return (old);
+}
+
+void scull_dedup_free(struct scull_store *store)
+{
+
+	kvfree(store->dedup);
+	store->dedup = NULL;
+}
+
+/*
+ * a quantum of the store equal to quantum, now shared with the caller;
+ * other qsets are only tried, taking their lock could deadlock with
+ * their writer
+ */
+static void *__scull_dedup_find(struct scull_store *store,
+		struct scull_qset *qset, const struct scull_follow *flw,
+		void *quantum)
+	__must_hold(&qset->lock)
+{
+	const	unsigned long	here = flw->qset_p * store->qset_len +
+		flw->quantum_p + 1;
+	struct	scull_dedup	*table;
+	struct	scull_qset	*other;
+	unsigned long	hash, where;
+	void	*dup = NULL;
+	size_t	i;
+
+	table = scull_dedup_table(store);
+	if (table == NULL)
+		return (NULL);
+	hash = xxhash(quantum, store->quantum_len, 0);
+	i = hash % SCULL_DEDUP_SLOTS;
+	where = READ_ONCE(table->slots[i].where);
+	if (where == 0 || where == here ||
+	    READ_ONCE(table->slots[i].hash) != hash)
+		goto remember;
+
+	where--;
+	other = xa_load(&store->qsets, where / store->qset_len);
+	if (other == NULL)
+		goto remember;
+	if (other != qset && !mutex_trylock(&other->lock))
+		return (NULL);
+	dup = rcu_dereference_protected(other->data[where % store->qset_len],
+			lockdep_is_held(&other->lock));
+	if (dup == NULL || scull_slot_tagged(dup) ||
+	    memcmp(dup, quantum, store->quantum_len) != 0 ||
+	    scull_quantum_share(dup) != 0)
+		dup = NULL;
+	else
+		/* from now on, writers of both slots copy first */
+		WRITE_ONCE(store->shared, true);
+	if (other != qset)
+		mutex_unlock(&other->lock);
+	if (dup != NULL)
+		return (dup);
+remember:
+	WRITE_ONCE(table->slots[i].hash, hash);
+	WRITE_ONCE(table->slots[i].where, here);
+	return (NULL);
+}
+
+/*
+ * put quantum in the slot in place of old, which readers may still use;
+ * without memory to retire it old simply stays
+ */
+static bool __scull_slot_replace(struct scull_store *store,
+		void __rcu **slot, void *old, void *quantum,
+		struct scull_retire **retire)
+{
+
+	if (*retire == NULL)
+		*retire = scull_retire_alloc(store, store->qset_len);
+	if (*retire == NULL)
+		return (false);
+	rcu_assign_pointer(*slot, quantum);
+	scull_retire_add(*retire, store, old);
+	return (true);
+}
+
+/*
+ * write a whole quantum of a slab backed store, at flw; a hole is only
+ * filled once the data is known. Quanta taken out go to retire, made on
+ * first use.
+ *
+ * returns the bytes written or an error
+ */
+ssize_t __scull_quantum_write_whole(struct scull_store *store,
+		struct scull_qset *qset, const struct scull_follow *flw,
+		struct iov_iter *from, struct scull_retire **retire)
+	__must_hold(&qset->lock)
+{
+	void	__rcu **slot = &qset->data[flw->quantum_p];
+	void	*old, *quantum, *dup;
+	size_t	n;
+
+	lockdep_assert_held(&qset->lock);
+
+	if (READ_ONCE(store->shared))
+		old = __scull_quantum_unshare(store, slot);
+	else
+		old = __scull_quantum_load(store, slot);
+	if (IS_ERR(old))
+		return (PTR_ERR(old));
+
+	quantum = old;
+	if (quantum == NULL) {
+		quantum = scull_quantum_alloc(store, GFP_KERNEL);
+		if (quantum == NULL)
+			return (-ENOMEM);
+	}
+	n = copy_from_iter(quantum, store->quantum_len, from);
+	if (n < store->quantum_len) {
+		/* what was copied is part of the device */
+		if (old == NULL && n == 0)
+			scull_quantum_free(store, quantum);
+		else if (old == NULL)
+			rcu_assign_pointer(*slot, quantum);
+		return (n);
+	}
+
+	if (memchr_inv(quantum, 0, store->quantum_len) == NULL) {
+		if (old == NULL)
+			scull_quantum_free(store, quantum);
+		else
+			__scull_slot_replace(store, slot, old, NULL, retire);
+		return (n);
+	}
+
+	dup = NULL;
+	if (scull_dedup)
+		dup = __scull_dedup_find(store, qset, flw, quantum);
+	if (dup != NULL) {
+		/* every owner counts, as with a snapshot */
+		scull_quantum_account(store, dup, 1);
+		if (old == NULL) {
+			scull_quantum_free(store, quantum);
+			rcu_assign_pointer(*slot, dup);
+		} else if (!__scull_slot_replace(store, slot, old, dup,
+		    retire)) {
+			scull_quantum_free(store, dup);
+		}
+		return (n);
+	}
+	if (old == NULL)
+		rcu_assign_pointer(*slot, quantum);
+	return (n);
+}
@@ -0,0 +1,291 @@
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+
+#include "mutex_sparse.h"
+#include "rwsem_sparse.h"
+#include "scull.h"
+
+/*
+ * first offset from pos on, below len, that is backed (data) or not
+ * backed (!data) by a quantum; len if there is none
+ */
+static loff_t __scull_seek_data(struct scull_store *store, loff_t pos,
+		size_t len, bool data)
+{
+	const	size_t	qset_bytes = store->quantum_len * store->qset_len;
+	struct	scull_qset	*qset;
+	struct	scull_follow	 flw;
+	unsigned long	idx;
+	bool	present;
+
+	qset = __scull_follow(store, &flw, &pos);
+	while (pos < (loff_t)len) {
+		if (qset == NULL) {
+			if (!data)
+				return (pos);
+			/* skip the missing qsets at once */
+			idx = flw.qset_p;
+			qset = xa_find(&store->qsets, &idx, ULONG_MAX,
+					XA_PRESENT);
+			if (qset == NULL)
+				break;
+			pos = (loff_t)idx * qset_bytes;
+			flw.qset_p = idx;
+			flw.quantum_p = 0;
+			flw.offset_p = 0;
+			continue;
+		}
+		for (; flw.quantum_p < store->qset_len && pos < (loff_t)len;
+		    flw.quantum_p++, flw.offset_p = 0) {
+			present = rcu_access_pointer(qset->data[flw.quantum_p])
+				!= NULL;
+			if (present == data)
+				return (pos);
+			pos += store->quantum_len - flw.offset_p;
+		}
+		__scull_follow_next(&flw);
+		qset = xa_load(&store->qsets, flw.qset_p);
+	}
+	return (len);
+}
+
+/*
+ * SEEK_DATA and SEEK_HOLE work at quantum granularity over the qset
+ * index; the end of the device is an implicit hole
+ */
+loff_t scull_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct	scull_dev	*dev = filp->private_data;
+	struct	scull_store	*store;
+	size_t	len;
+	int	idx;
+
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	len = smp_load_acquire(&store->len);
+
+	switch (whence) {
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		if (off < 0 || off >= (loff_t)len) {
+			off = -ENXIO;
+			break;
+		}
+		off = __scull_seek_data(store, off, len, whence == SEEK_DATA);
+		if (whence == SEEK_DATA && off >= (loff_t)len)
+			off = -ENXIO;
+		else
+			off = vfs_setpos(filp, off, MAX_LFS_FILESIZE);
+		break;
+	default:
+		off = generic_file_llseek_size(filp, off, whence,
+				MAX_LFS_FILESIZE, len);
+		break;
+	}
+	srcu_read_unlock(&scull_srcu, idx);
+	return (off);
+}
+
+/*
+ * give every quantum in [pos, end) memory, qsets and quanta are
+ * allocated in bulk like for a large write
+ */
+static int __scull_allocate(struct scull_store *store, loff_t pos,
+		loff_t end)
+{
+	const	size_t	qset_bytes = store->quantum_len * store->qset_len;
+	struct	scull_qset	*qset;
+	struct	scull_follow	 flw;
+	void	**quanta, *quantum;
+	size_t	want, i, nr;
+	int	ret = 0;
+
+	quanta = kmalloc_array(store->qset_len, sizeof(*quanta), GFP_KERNEL);
+	if (quanta == NULL)
+		return (-ENOMEM);
+
+	__scull_follow(store, &flw, &pos);
+	__scull_qsets_reserve(store, flw.qset_p, (end - 1) / qset_bytes);
+	while (pos < end) {
+		qset = __scull_follow(store, &flw, &pos);
+		if (qset == NULL)
+			qset = __scull_qset_alloc(store, flw.qset_p);
+		if (qset == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		want = min_t(size_t, end - pos, __scull_qset_left(store, &flw));
+		nr = DIV_ROUND_UP(flw.offset_p + want, store->quantum_len);
+
+		if (__mutex_lock_interruptible_sparse(&qset->lock)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		__scull_qset_fill(store, qset, flw.quantum_p, nr, quanta);
+		/* whatever the bulk could not cover */
+		for (i = flw.quantum_p; i < flw.quantum_p + nr; i++) {
+			if (rcu_access_pointer(qset->data[i]) != NULL)
+				continue;
+			quantum = scull_quantum_alloc_at(store, qset, i);
+			if (quantum == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+			__scull_quantum_install(store, &qset->data[i], quantum);
+		}
+		__mutex_unlock_sparse(&qset->lock);
+		if (ret)
+			break;
+		pos += want;
+	}
+	kfree(quanta);
+	return (ret);
+}
+
+/*
+ * release the quanta fully inside [pos, end) and zero the partial ones
+ * at both ends; the qsets stay in place. The range may go past the end
+ * of the device, over space preallocated with FALLOC_FL_KEEP_SIZE
+ */
+static int __scull_punch_hole(struct scull_store *store, loff_t pos,
+		loff_t end)
+{
+	const	size_t	qset_bytes = store->quantum_len * store->qset_len;
+	struct	scull_retire	*retire;
+	struct	scull_qset	*qset;
+	struct	scull_follow	 flw;
+	unsigned long	idx;
+	size_t	want, chunk;
+	void	*quantum;
+	int	ret = 0;
+
+	while (pos < end) {
+		qset = __scull_follow(store, &flw, &pos);
+		if (qset == NULL) {
+			/* skip the missing qsets at once */
+			idx = flw.qset_p;
+			if (xa_find(&store->qsets, &idx, ULONG_MAX,
+			    XA_PRESENT) == NULL)
+				break;
+			pos = (loff_t)idx * qset_bytes;
+			continue;
+		}
+		want = min_t(size_t, end - pos, __scull_qset_left(store, &flw));
+		pos += want;
+
+		retire = scull_retire_alloc(store, store->qset_len);
+		if (retire == NULL)
+			return (-ENOMEM);
+		if (__mutex_lock_interruptible_sparse(&qset->lock)) {
+			scull_retire(retire);
+			return (-ERESTARTSYS);
+		}
+		for (; want != 0; flw.quantum_p++, flw.offset_p = 0) {
+			chunk = min(want, store->quantum_len - flw.offset_p);
+			want -= chunk;
+			if (chunk == store->quantum_len) {
+				/* a page fault may be unsharing it */
+				quantum = xchg((void __force **)
+						&qset->data[flw.quantum_p], NULL);
+				if (quantum != NULL)
+					scull_retire_add(retire, store,
+							quantum);
+				continue;
+			}
+			if (READ_ONCE(store->shared))
+				quantum = __scull_quantum_unshare(store,
+						&qset->data[flw.quantum_p]);
+			else
+				quantum = __scull_quantum_load(store,
+						&qset->data[flw.quantum_p]);
+			if (IS_ERR(quantum)) {
+				ret = PTR_ERR(quantum);
+				break;
+			}
+			if (quantum != NULL && store->dax != NULL)
+				scull_dax_zero(quantum + flw.offset_p, chunk);
+			else if (quantum != NULL)
+				memset(quantum + flw.offset_p, 0, chunk);
+		}
+		__mutex_unlock_sparse(&qset->lock);
+		scull_retire(retire);
+		if (ret)
+			break;
+	}
+	if (store->dax != NULL)
+		scull_dax_flush(store->dax);
+	return (ret);
+}
+
+/*
+ * pages still mapped would keep what the hole frees, so a page backed
+ * device is punched alone and only while unmapped
+ */
+static long scull_punch_hole(struct scull_dev *dev, loff_t pos, loff_t end)
+{
+	struct	scull_store	*store;
+	long	ret;
+
+	if (!scull_pages) {
+		if (__down_read_killable_sparse(&dev->lock))
+			return (-ERESTARTSYS);
+		store = scull_store_locked(dev);
+		ret = __scull_punch_hole(store, pos, end);
+		__up_read_sparse(&dev->lock);
+		return (ret);
+	}
+
+	if (__down_write_killable_sparse(&dev->lock))
+		return (-ERESTARTSYS);
+	store = scull_store_locked(dev);
+	if (!__scull_maps_block(dev, store)) {
+		ret = -EBUSY;
+	} else {
+		ret = __scull_punch_hole(store, pos, end);
+		__scull_maps_unblock(dev, store);
+	}
+	__up_write_sparse(&dev->lock);
+	return (ret);
+}
+
+/*
+ * fallocate(2) semantics: preallocate, extending the device unless
+ * FALLOC_FL_KEEP_SIZE is given, or punch a hole
+ */
+long scull_fallocate(struct scull_dev *dev, int mode, loff_t offset,
+		loff_t len)
+{
+	struct	scull_store	*store;
+	loff_t	end;
+	long	ret;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return (-EOPNOTSUPP);
+	/* same rule as the filesystems */
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+		return (-EOPNOTSUPP);
+	if (offset < 0 || len <= 0)
+		return (-EINVAL);
+	if (check_add_overflow(offset, len, &end) || end > MAX_LFS_FILESIZE)
+		return (-EFBIG);
+
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		return (scull_punch_hole(dev, offset, end));
+
+	if (__down_read_killable_sparse(&dev->lock))
+		return (-ERESTARTSYS);
+	/* a compact store would take it all at one quantum per qset */
+	store = __scull_store_grow(dev, scull_store_locked(dev), end);
+	if ((store->dax != NULL && end > scull_dax_size(store->dax)) ||
+	    scull_spill_full(store)) {
+		/* the region ends there, or nothing more fits */
+		ret = -ENOSPC;
+	} else {
+		ret = __scull_allocate(store, offset, end);
+		if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE))
+			__scull_store_extend(store, end);
+	}
+	__up_read_sparse(&dev->lock);
+	return (ret);
+}
@@ -1,10 +1,199 @@
 #include <linux/capability.h>
+#include <linux/file.h>
+#include <linux/nodemask.h>
 #include <linux/uaccess.h>
 
 #include "ioctl.h"
 #include "pipe.h"
 #include "scull.h"
 
+static long scull_ioc_fallocate(struct file *filp, void __user *arg)
+{
+	struct	scull_dev	*dev = scull_dev_of(filp);
+	struct	scull_falloc	 fa;
+
+	/* not on the pipes */
+	if (dev == NULL)
+		return (-ENOTTY);
+	if (!(filp->f_mode & FMODE_WRITE))
+		return (-EBADF);
+	if (copy_from_user(&fa, arg, sizeof(fa)))
+		return (-EFAULT);
+	if (fa.offset > MAX_LFS_FILESIZE || fa.len > MAX_LFS_FILESIZE)
+		return (-EFBIG);
+
+	return (scull_fallocate(dev, fa.mode, fa.offset, fa.len));
+}
+
+static long scull_ioc_snapshot(struct file *filp, int fd)
+{
+	struct	scull_dev	*dev = scull_dev_of(filp), *src;
+	struct	fd	f;
+	long	ret;
+
+	if (dev == NULL)
+		return (-ENOTTY);
+	if (!(filp->f_mode & FMODE_WRITE))
+		return (-EBADF);
+	f = fdget(fd);
+	if (f.file == NULL)
+		return (-EBADF);
+
+	src = scull_dev_of(f.file);
+	if (src == NULL || src == dev)
+		ret = -EINVAL;
+	else if (!(f.file->f_mode & FMODE_READ))
+		ret = -EBADF;
+	else
+		ret = scull_snapshot(src, dev);
+	fdput(f);
+	return (ret);
+}
+
+static long scull_ioc_geometry(struct file *filp, unsigned int cmd,
+		void __user *arg)
+{
+	struct	scull_dev	*dev = scull_dev_of(filp);
+	struct	scull_geometry	 geo;
+	struct	scull_store	*store;
+	int	idx;
+
+	if (dev == NULL)
+		return (-ENOTTY);
+	if (cmd == SCULL_IOCGGEOMETRY) {
+		idx = srcu_read_lock(&scull_srcu);
+		store = srcu_dereference(dev->store, &scull_srcu);
+		geo.quantum = store->quantum_len;
+		geo.qset = store->qset_len;
+		/* what it grows into */
+		if (store->compact)
+			geo.qset = dev->qset ? dev->qset : scull_qset;
+		srcu_read_unlock(&scull_srcu, idx);
+		return (copy_to_user(arg, &geo, sizeof(geo)) ? -EFAULT : 0);
+	}
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return (-EBADF);
+	if (copy_from_user(&geo, arg, sizeof(geo)))
+		return (-EFAULT);
+	if ((size_t)geo.quantum != geo.quantum ||
+	    (size_t)geo.qset != geo.qset)
+		return (-EINVAL);
+	if (cmd == SCULL_IOCREPACK)
+		return (scull_repack(dev, geo.quantum, geo.qset));
+	return (scull_set_geometry(dev, geo.quantum, geo.qset));
+}
+
+static long scull_ioc_placement(struct file *filp, unsigned int cmd,
+		void __user *arg)
+{
+	struct	scull_dev	*dev = scull_dev_of(filp);
+	struct	scull_placement	 place;
+
+	if (dev == NULL)
+		return (-ENOTTY);
+	if (cmd == SCULL_IOCGPLACEMENT) {
+		place.policy = READ_ONCE(dev->policy);
+		place.node = READ_ONCE(dev->node);
+		return (copy_to_user(arg, &place, sizeof(place)) ? -EFAULT : 0);
+	}
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return (-EBADF);
+	if (copy_from_user(&place, arg, sizeof(place)))
+		return (-EFAULT);
+	switch (place.policy) {
+	case SCULL_PLACE_LOCAL:
+	case SCULL_PLACE_INTERLEAVE:
+		place.node = NUMA_NO_NODE;
+		break;
+	case SCULL_PLACE_BIND:
+		if (place.node < 0 || place.node >= nr_node_ids ||
+		    !node_state(place.node, N_MEMORY))
+			return (-EINVAL);
+		break;
+	default:
+		return (-EINVAL);
+	}
+	return (scull_set_placement(dev, place.policy, place.node));
+}
+
+static long scull_ioc_limit(struct file *filp, void __user *arg)
+{
+	struct	scull_dev	*dev = scull_dev_of(filp);
+	struct	scull_limit	 lim;
+	struct	fd	f;
+	long	ret;
+
+	if (dev == NULL)
+		return (-ENOTTY);
+	if (!(filp->f_mode & FMODE_WRITE))
+		return (-EBADF);
+	if (copy_from_user(&lim, arg, sizeof(lim)))
+		return (-EFAULT);
+	if ((size_t)lim.limit != lim.limit || (size_t)lim.size != lim.size)
+		return (-EINVAL);
+
+	if (lim.fd != -1) {
+		f = fdget(lim.fd);
+		if (f.file == NULL)
+			return (-EBADF);
+		/*
+		 * a device could come back to us; appending would put
+		 * every quantum at the end of the file, not at its offset
+		 */
+		if (!S_ISREG(file_inode(f.file)->i_mode) ||
+		    (f.file->f_flags & O_APPEND))
+			ret = -EINVAL;
+		else if ((f.file->f_mode & (FMODE_READ | FMODE_WRITE)) !=
+		    (FMODE_READ | FMODE_WRITE))
+			ret = -EBADF;
+		else
+			ret = scull_set_limit(dev, lim.limit, f.file, lim.size);
+		fdput(f);
+		return (ret);
+	}
+	return (scull_set_limit(dev, lim.limit, NULL, 0));
+}
+
+static long scull_ioc_checkpoint(struct file *filp, int fd)
+{
+	struct	fd	f;
+	long	ret;
+
+	if (scull_dev_of(filp) == NULL)
+		return (-ENOTTY);
+	/* every device goes out */
+	if (!capable(CAP_SYS_ADMIN))
+		return (-EPERM);
+	f = fdget(fd);
+	if (f.file == NULL)
+		return (-EBADF);
+	/* the image is written at its offsets, not appended */
+	if (!S_ISREG(file_inode(f.file)->i_mode) ||
+	    (f.file->f_flags & O_APPEND))
+		ret = -EINVAL;
+	else if (!(f.file->f_mode & FMODE_WRITE))
+		ret = -EBADF;
+	else
+		ret = scull_checkpoint(f.file);
+	fdput(f);
+	return (ret);
+}
+
+static long scull_ioc_batch(struct file *filp, void __user *arg)
+{
+	struct	scull_dev	*dev = scull_dev_of(filp);
+	struct	scull_batch	 batch;
+
+	if (dev == NULL)
+		return (-ENOTTY);
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return (-EFAULT);
+	return (scull_batch(dev, filp, u64_to_user_ptr(batch.ents),
+			batch.nr));
+}
+
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int tmp;
@@ -79,6 +268,23 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	  case SCULL_P_IOCQSIZE:
 		return (scull_p_len);
 		break;
+	case SCULL_IOCFALLOCATE:
+		return (scull_ioc_fallocate(filp, (void __user *)arg));
+	case SCULL_IOCTSNAPSHOT:
+		return (scull_ioc_snapshot(filp, arg));
+	case SCULL_IOCSGEOMETRY:
+	case SCULL_IOCGGEOMETRY:
+	case SCULL_IOCREPACK:
+		return (scull_ioc_geometry(filp, cmd, (void __user *)arg));
+	case SCULL_IOCSPLACEMENT:
+	case SCULL_IOCGPLACEMENT:
+		return (scull_ioc_placement(filp, cmd, (void __user *)arg));
+	case SCULL_IOCSLIMIT:
+		return (scull_ioc_limit(filp, (void __user *)arg));
+	case SCULL_IOCBATCH:
+		return (scull_ioc_batch(filp, (void __user *)arg));
+	case SCULL_IOCTCHECKPOINT:
+		return (scull_ioc_checkpoint(filp, arg));
 	default:
 		return (-ENOTTY);
 	}
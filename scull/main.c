@@ -4,29 +4,40 @@
 
 #include <linux/uaccess.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/fcntl.h>
+#include <linux/uio.h>
 
 #include "ioctl.h"
 #include "mutex_sparse.h"
 #include "pipe.h"
 #include "proc.h"
+#include "rwsem_sparse.h"
 #include "scull.h"
 
 int 	scull_major = SCULL_MAJOR;
 static int 	scull_minor = 0;
 ulong 	scull_nr_devs = SCULL_NR_DEVS;
+ulong	scull_nr_blk;		/* block devices, see blk.c */
+ulong	scull_blk_size = SCULL_BLK_SIZE;
 ulong	scull_quantum = SCULL_QUANTUM;
 ulong	scull_qset = SCULL_QSET;
+bool	scull_pages;		/* page backed quanta, see mmap.c */
+static bool	scull_compact = true;	/* small devices, see __scull_store_geometry() */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, ulong, S_IRUGO);
+module_param(scull_nr_blk, ulong, S_IRUGO);
+module_param(scull_blk_size, ulong, S_IRUGO);
 module_param(scull_quantum, ulong, S_IRUGO);
 module_param(scull_qset, ulong, S_IRUGO);
+module_param(scull_pages, bool, S_IRUGO);
+module_param(scull_compact, bool, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -34,55 +45,281 @@ MODULE_LICENSE("Dual BSD/GPL");
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 static struct file_operations scull_fops = {
 	.owner =    THIS_MODULE,
-	/*.llseek =   scull_llseek,*/
-	.read =     scull_read,
-	.write =    scull_write,
+	.llseek =   scull_llseek,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
+	.splice_read =  scull_splice_read,
+	.splice_write = iter_file_splice_write,
 	.unlocked_ioctl = scull_ioctl,
+	.mmap =     scull_mmap,
 	.open =     scull_open,
 	/*.release =  scull_release,*/
 };
 
-static struct kmem_cache *kmc;
 /*
- * empty out scull device -> must be called with the device mutex held
+ * readers walk a store under scull_srcu instead of dev->lock; they
+ * copy to user space and may sleep, hence SRCU rather than plain RCU
  */
-static void __scull_trim(struct scull_dev *dev) 
+DEFINE_SRCU(scull_srcu);
+
+/* releases trimmed stores */
+struct workqueue_struct *scull_wq;
+
+/*
+ * page backed quanta are a power of two number of pages, slab quanta
+ * come from the cache of their size class; the store must be empty
+ */
+int __scull_store_layout(struct scull_store *store, size_t quantum,
+		size_t qset)
+{
+	struct	scull_cache	*cache = NULL;
+	size_t	bytes;
+
+	if (scull_pages) {
+		if (quantum == 0 || get_order(quantum) >= MAX_ORDER)
+			return (-EINVAL);
+		quantum = PAGE_SIZE << get_order(quantum);
+	} else {
+		cache = scull_quantum_cache(quantum);
+		if (IS_ERR(cache))
+			return (PTR_ERR(cache));
+	}
+	if (qset == 0 || qset > KMALLOC_MAX_SIZE / sizeof(void *) ||
+	    check_mul_overflow(quantum, qset, &bytes))
+		return (-EINVAL);
+
+	store->pages = scull_pages;
+	store->cache = cache;
+	store->quantum_len = quantum;
+	store->qset_len = qset;
+	store->compact = false;
+	return (0);
+}
+
+/*
+ * the geometry of dev; with scull_compact, a new store starts out with a
+ * single slot per qset, which spares small devices a qset_len pointer
+ * array, and gets the full qset size once a write goes past its first
+ * quantum (see __scull_store_grow())
+ */
+static int __scull_store_geometry(struct scull_store *store,
+		const struct scull_dev *dev)
+{
+	int ret;
+
+	if (dev->dax != NULL)
+		return (scull_dax_layout(dev->dax, store,
+				dev->qset ? dev->qset : scull_qset));
+	ret = __scull_store_layout(store,
+			dev->quantum ? dev->quantum : scull_quantum,
+			dev->qset ? dev->qset : scull_qset);
+	if (ret == 0 && scull_compact && store->qset_len > 1) {
+		store->qset_len = 1;
+		store->compact = true;
+	}
+	return (ret);
+}
+
+struct scull_store *scull_store_alloc(const struct scull_dev *dev)
+{
+	struct scull_store *store;
+
+	store = kzalloc(sizeof(*store), GFP_KERNEL);
+	if (store == NULL)
+		return (NULL);
+	xa_init(&store->qsets);
+	INIT_LIST_HEAD(&store->appends);
+	store->stats.nodes = kcalloc(nr_node_ids, sizeof(atomic_long_t),
+			GFP_KERNEL);
+	if (store->stats.nodes == NULL || __scull_store_geometry(store, dev)) {
+		kfree(store->stats.nodes);
+		kfree(store);
+		return (NULL);
+	}
+	store->policy = dev->policy;
+	store->node = dev->node;
+	store->rotor = MAX_NUMNODES;
+	store->spill = dev->spill;
+	return (store);
+}
+
+/*
+ * release a store nobody can reach anymore
+ */
+void scull_store_free(struct scull_store *store)
+{
+	struct 	scull_qset	*qset;
+	unsigned long	idx;
+
+	if (store == NULL)
+		return;
+
+	xa_for_each(&store->qsets, idx, qset) {
+		scull_quantum_free_bulk(store, store->qset_len,
+				(void __force **)qset->data);
+		kfree(qset->data);
+		kfree(qset);
+	}
+	xa_destroy(&store->qsets);
+	scull_dedup_free(store);
+	kfree(store->stats.nodes);
+	kfree(store);
+}
+
+static void scull_store_free_work(struct work_struct *work)
+{
+	struct	scull_store	*store;
+	struct	scull_dev	*dev;
+
+	store = container_of(work, struct scull_store, free_work);
+	dev = store->moved;
+	scull_store_free(store);
+	/* the shares of a repack are gone with it */
+	if (dev != NULL)
+		scull_store_unshared(dev);
+}
+
+static void scull_store_free_rcu(struct rcu_head *rcu)
+{
+	struct scull_store *store = container_of(rcu, struct scull_store, rcu);
+
+	/* SRCU callbacks run in softirq context, no place to free a tree */
+	INIT_WORK(&store->free_work, scull_store_free_work);
+	queue_work(scull_wq, &store->free_work);
+}
+
+/*
+ * publish store in place of the current one, which is handed to scull_wq
+ * once all readers that may still see it are gone
+ */
+void __scull_store_replace(struct scull_dev *dev, struct scull_store *store)
 	__must_hold(&dev->lock)
 {
-	struct 	scull_qset	*qset, *next;
+	struct scull_store *old;
 
-	lockdep_assert_held(&dev->lock);
+	lockdep_assert_held_write(&dev->lock);
+
+	old = scull_store_locked(dev);
+	rcu_assign_pointer(dev->store, store);
+	call_srcu(&scull_srcu, &old->rcu, scull_store_free_rcu);
+}
+
+/*
+ * empty out scull device -> must be called with the device lock
+ * held for writing
+ *
+ * a fresh store is published and the old one is handed to scull_wq once
+ * all readers that may still see it are gone, so the cost of a trim does
+ * not depend on the size of the device
+ */
+static int __scull_trim(struct scull_dev *dev) 
+	__must_hold(&dev->lock)
+{
+	struct 	scull_store	*old, *store;
+
+	lockdep_assert_held_write(&dev->lock);
+
+	old = scull_store_locked(dev);
+	/*
+	 * an empty store has no reader depending on its geometry, so it
+	 * may be updated in place
+	 */
+	if (xa_empty(&old->qsets) && old->len == 0)
+		return (__scull_store_geometry(old, dev));
+
+	/* mapped pages would outlive the trim */
+	if (!__scull_maps_block(dev, old))
+		return (-EBUSY);
+	store = scull_store_alloc(dev);
+	if (store == NULL) {
+		__scull_maps_unblock(dev, old);
+		return (-ENOMEM);
+	}
+	__scull_store_replace(dev, store);
+	__scull_maps_unblock(dev, old);
+	/* the old store keeps its frames, but not in the region */
+	if (dev->dax != NULL)
+		scull_dax_clear(dev->dax);
+	return (0);
+}
+
+/*
+ * own geometry of dev, it must be empty
+ */
+int scull_set_geometry(struct scull_dev *dev, size_t quantum, size_t qset)
+{
+	struct	scull_store	*store;
+	int	ret = -EBUSY;
 
-	for (qset = dev->qset; qset != NULL; qset = next) {
-		if (qset->data != NULL) {
-			kmem_cache_free_bulk(kmc, dev->qset_len - 1, qset->data);
-			kfree(qset->data);
-			qset->data = NULL;
+	/* the region has its own */
+	if (dev->dax != NULL)
+		return (-EINVAL);
+	if (__down_write_killable_sparse(&dev->lock))
+		return (-ERESTARTSYS);
+	store = scull_store_locked(dev);
+	if (xa_empty(&store->qsets) && store->len == 0) {
+		ret = __scull_store_layout(store,
+				quantum ? quantum : scull_quantum,
+				qset ? qset : scull_qset);
+		if (ret == 0) {
+			dev->quantum = quantum;
+			dev->qset = qset;
+			__scull_store_geometry(store, dev);
 		}
-		next = qset->next;
-		kfree(qset);
 	}
-	dev->len = 0;
-	dev->quantum_len = scull_quantum;
-	dev->qset_len = scull_qset;
-	dev->qset = NULL;
+	__up_write_sparse(&dev->lock);
+	return (ret);
+}
+
+/*
+ * placement of the quanta dev allocates from now on
+ */
+int scull_set_placement(struct scull_dev *dev, u32 policy, int node)
+{
+	struct scull_store *store;
+
+	if (__down_write_killable_sparse(&dev->lock))
+		return (-ERESTARTSYS);
+	store = scull_store_locked(dev);
+	dev->policy = policy;
+	dev->node = node;
+	/* page faults allocate without the lock */
+	WRITE_ONCE(store->node, node);
+	WRITE_ONCE(store->policy, policy);
+	__up_write_sparse(&dev->lock);
+	return (0);
 }
 
 int scull_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev;
+	int ret = 0;
 
 	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
 	filp->private_data = dev;
+	/* RWF_NOWAIT and io_uring, see __scull_write() */
+	filp->f_mode |= FMODE_NOWAIT;
 
 	/* is it write only? then trim it */
 	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (__mutex_lock_interruptible_sparse(&dev->lock))
+		if (__down_write_killable_sparse(&dev->lock))
 			return (-ERESTARTSYS);
-		__scull_trim(dev);
-		__mutex_unlock_sparse(&dev->lock);
+		ret = __scull_trim(dev);
+		__up_write_sparse(&dev->lock);
 	}
-	return (0);
+	return (ret);
+}
+
+/*
+ * the device behind filp, NULL if it is not a scull memory device (the
+ * pipes share scull_ioctl)
+ */
+struct scull_dev *scull_dev_of(struct file *filp)
+{
+
+	if (filp->f_op != &scull_fops)
+		return (NULL);
+	return (filp->private_data);
 }
 
 int scull_release(struct inode *inode, struct file *filp)
@@ -91,148 +328,678 @@ int scull_release(struct inode *inode, struct file *filp)
 	return (0);
 }
 
-static struct scull_qset *__scull_follow(struct scull_dev *dev, 
+/*
+ * locate the qset holding f_pos, NULL for a hole
+ *
+ * called with either scull_srcu read-held or the device lock held
+ */
+struct scull_qset *__scull_follow(struct scull_store *store, 
 		struct scull_follow *flw, const loff_t *f_pos)
-	__must_hold(&dev->lock)
 {
-	const 	size_t 	total_len = dev->quantum_len * dev->qset_len;
+	const 	size_t 	total_len = store->quantum_len * store->qset_len;
 	const 	size_t	rest = *f_pos % total_len;
-	struct	scull_qset *qset;
-	size_t	n;
-
-	lockdep_assert_held(&dev->lock);
 
 	/* which qset */
 	flw->qset_p = *f_pos / total_len;
 	/* which quantum + offset */
-	flw->quantum_p = rest / dev->quantum_len;
-	flw->offset_p = rest % dev->quantum_len;
+	flw->quantum_p = rest / store->quantum_len;
+	flw->offset_p = rest % store->quantum_len;
 
-	qset = dev->qset;
-	if (qset == NULL) {
-		qset = dev->qset = kcalloc(1, sizeof(*dev->qset), GFP_KERNEL);
-		if (qset == NULL)
-			return (NULL);
-	}
+	return (xa_load(&store->qsets, flw->qset_p));
+}
 
-	n = flw->qset_p;
-	while(n--) {
-		if (qset->next == NULL) {
-			qset->next = kcalloc(1, sizeof(*qset->next), GFP_KERNEL);
-			if (qset->next == NULL)
-				return (NULL);
-		}
-		qset = qset->next;
+/*
+ * allocate and publish the qset at index idx; callers racing for the
+ * same index are serialized by the xarray lock and share one qset
+ *
+ * called with either scull_srcu read-held or the device lock held
+ */
+struct scull_qset *__scull_qset_alloc(struct scull_store *store,
+		unsigned long idx)
+{
+	struct	scull_qset *qset, *old;
+
+	/* the pointer array is in place before readers can find the qset */
+	qset = kzalloc(sizeof(*qset), GFP_KERNEL);
+	if (qset == NULL)
+		return (NULL);
+	qset->data = kcalloc(store->qset_len, sizeof(*qset->data), GFP_KERNEL);
+	if (qset->data == NULL)
+		goto fail;
+	mutex_init(&qset->lock);
+	qset->atime = jiffies;
+	qset->idx = idx;
+
+	old = xa_cmpxchg(&store->qsets, idx, NULL, qset, GFP_KERNEL);
+	if (xa_is_err(old))
+		goto fail;
+	if (old != NULL) {
+		kfree(qset->data);
+		kfree(qset);
+		return (old);
 	}
+	atomic_long_inc(&store->stats.qsets);
 	return (qset);
+fail:
+	kfree(qset->data);
+	kfree(qset);
+	return (NULL);
+}
+
+/*
+ * claim an empty quantum slot, the loser of a race frees its quantum
+ * unless it is the very frame of pmem the winner installed; returns the
+ * quantum now in the slot
+ */
+void *__scull_quantum_install(struct scull_store *store, void __rcu **slot,
+		void *quantum)
+{
+	void *old;
+
+	/* fully ordered, the zeroed quantum is visible before the pointer */
+	old = cmpxchg((void __force **)slot, NULL, quantum);
+	if (old == NULL)
+		return (quantum);
+	if (old != quantum)
+		scull_quantum_free(store, quantum);
+	return (old);
+}
+
+/*
+ * the quantum in slot, decompressed or read back from the backing file
+ * first if need be; called with scull_srcu read-held, the qset lock or the
+ * device lock held for writing
+ *
+ * returns NULL on a hole, an ERR_PTR on failure
+ */
+void *__scull_quantum_load(struct scull_store *store, void __rcu **slot)
+{
+	void *quantum;
+
+	quantum = READ_ONCE(*(void __force **)slot);
+	/* error pointers look tagged too */
+	while (!IS_ERR(quantum) && scull_slot_tagged(quantum)) {
+		if (scull_slot_compressed(quantum))
+			quantum = scull_quantum_inflate(store, slot, quantum);
+		else
+			quantum = scull_quantum_unspill(store, slot, quantum);
+	}
+	return (quantum);
+}
+
+/*
+ * a quantum of to holding what a compressed or spilled slot of store
+ * does, the slot is left as it is; called with scull_srcu read-held
+ *
+ * returns an ERR_PTR on failure
+ */
+void *__scull_quantum_clone(struct scull_store *store,
+		struct scull_store *to, void *tagged)
+{
+	void	*quantum;
+	int	ret;
+
+	quantum = scull_quantum_alloc(to, GFP_KERNEL);
+	if (quantum == NULL)
+		return (ERR_PTR(-ENOMEM));
+	if (scull_slot_compressed(tagged))
+		ret = scull_zquantum_read(store, tagged, quantum);
+	else
+		ret = scull_spill_read(store, tagged, quantum);
+	if (ret) {
+		scull_quantum_free(to, quantum);
+		return (ERR_PTR(ret));
+	}
+	return (quantum);
 }
 
-static void __scull_meminfo(const struct scull_dev *dev)
+/*
+ * the quantum in slot, made private to store before it is written to: a
+ * quantum still shared with a snapshot is replaced by a copy. Page faults
+ * do this without the qset lock, hence the cmpxchg.
+ *
+ * returns NULL on a hole, an ERR_PTR without memory
+ */
+void *__scull_quantum_unshare(struct scull_store *store, void __rcu **slot)
 {
-	const 	struct scull_qset *qset = dev->qset;
-	size_t 	i, mem = 0, tmem = 0;
+	struct	scull_retire	*retire;
+	void	*quantum, *copy;
 
-	for (/* nothing */; qset != NULL; qset = qset->next) {
-		tmem += sizeof(*qset);
-		mem += sizeof(*qset);
-		if (qset->data == NULL)
+	for (;;) {
+		quantum = __scull_quantum_load(store, slot);
+		if (IS_ERR_OR_NULL(quantum))
+			return (quantum);
+		if (!scull_quantum_shared(quantum)) {
+			/* not shared anymore, unless replaced meanwhile */
+			smp_rmb();
+			if (READ_ONCE(*(void __force **)slot) == quantum)
+				return (quantum);
 			continue;
+		}
 
-		tmem += dev->qset_len * sizeof(*qset->data);
-		mem += dev->len;
-		for (i = 0; i < dev->qset_len; i++) {
-			if (qset->data[i] == NULL)
-				break;
-			tmem += dev->quantum_len;
-			mem += sizeof(*qset->data);
+		copy = scull_quantum_alloc(store, GFP_KERNEL);
+		retire = scull_retire_alloc(store, 1);
+		if (copy == NULL || retire == NULL) {
+			scull_quantum_free(store, copy);
+			kfree(retire);
+			return (ERR_PTR(-ENOMEM));
+		}
+		memcpy(copy, quantum, store->quantum_len);
+		if (cmpxchg((void __force **)slot, quantum, copy) == quantum) {
+			/* readers may still be on the shared one */
+			scull_retire_add(retire, store, quantum);
+			scull_retire(retire);
+			return (copy);
 		}
+		scull_quantum_free(store, copy);
+		scull_retire(retire);
 	}
-	pr_debug("mem usage for qset %p: total [%zu] kb use [%zu] bytes\n", 
-	    dev->qset, tmem/1024, mem);
 }
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count, 
-		loff_t *f_pos)
+/*
+ * grow the device up to end, but not over an append still in flight:
+ * the rest waits in pending until the first one is written
+ */
+static void __scull_store_settle(struct scull_store *store, size_t end)
+	__must_hold(&store->qsets.xa_lock)
+{
+	struct scull_append *first;
+
+	first = list_first_entry_or_null(&store->appends,
+			struct scull_append, list);
+	if (first != NULL) {
+		store->pending = max(store->pending, end);
+		end = min(store->pending, first->start);
+	} else {
+		end = max(end, store->pending);
+		store->pending = 0;
+	}
+	/* the data must be visible before the new length */
+	if (store->len < end) {
+		smp_store_release(&store->len, end);
+		if (store->dax != NULL)
+			scull_dax_set_len(store->dax, end);
+	}
+}
+
+/*
+ * concurrent writers only serialize here
+ */
+void __scull_store_extend(struct scull_store *store, size_t end)
+{
+
+	xa_lock(&store->qsets);
+	__scull_store_settle(store, end);
+	xa_unlock(&store->qsets);
+}
+
+/*
+ * bytes from flw up to the end of its qset
+ */
+size_t __scull_qset_left(const struct scull_store *store,
+		const struct scull_follow *flw)
+{
+
+	return ((store->qset_len - flw->quantum_p) * store->quantum_len -
+			flw->offset_p);
+}
+
+void __scull_follow_next(struct scull_follow *flw)
+{
+
+	flw->qset_p++;
+	flw->quantum_p = 0;
+	flw->offset_p = 0;
+}
+
+/*
+ * copy count bytes of qset, starting at flw, into to; count must not
+ * go past the qset. A NULL qset or quantum is a hole and reads as zeroes.
+ * With nowait, a quantum that would have to be decompressed or read back
+ * ends the copy with -EAGAIN
+ */
+static ssize_t __scull_qset_read(struct scull_store *store,
+		struct scull_qset *qset, struct scull_follow *flw,
+		struct iov_iter *to, size_t count, bool nowait)
+{
+	ssize_t	err = 0;
+	size_t	chunk, n, done;
+	void	*quantum;
+
+	if (qset != NULL)
+		scull_qset_touch(qset);
+	for (done = 0; done < count; flw->quantum_p++, flw->offset_p = 0) {
+		chunk = min(count - done, store->quantum_len - flw->offset_p);
+		quantum = NULL;
+		if (qset != NULL && nowait && scull_slot_tagged(
+		    rcu_access_pointer(qset->data[flw->quantum_p]))) {
+			err = -EAGAIN;
+			break;
+		}
+		if (qset != NULL)
+			quantum = __scull_quantum_load(store,
+					&qset->data[flw->quantum_p]);
+		if (IS_ERR(quantum)) {
+			err = PTR_ERR(quantum);
+			break;
+		}
+		if (quantum != NULL)
+			n = copy_to_iter(quantum + flw->offset_p, chunk, to);
+		else
+			n = iov_iter_zero(chunk, to);
+		done += n;
+		if (n < chunk) {
+			err = -EFAULT;
+			break;
+		}
+	}
+	if (done == 0)
+		return (err);
+	return (done);
+}
+
+/*
+ * move a whole request across quanta and qsets; the qset index is only
+ * looked up once per qset
+ */
+ssize_t __scull_read(struct scull_store *store, struct iov_iter *to,
+		loff_t *f_pos, bool nowait)
 {
-	struct	scull_dev 	*dev = filp->private_data;
+	/* pairs with the release in __scull_store_extend() */
+	const	size_t	len = smp_load_acquire(&store->len);
 	struct	scull_qset	*qset;
 	struct	scull_follow	 flw;
-	ssize_t	ssret = 0;
+	size_t	count, want, done = 0;
+	ssize_t	n;
+
+	if (*f_pos >= len)
+		return (0);
+	count = min_t(size_t, iov_iter_count(to), len - *f_pos);
+
+	qset = __scull_follow(store, &flw, f_pos);
+	while (done < count) {
+		want = min(count - done, __scull_qset_left(store, &flw));
+		n = __scull_qset_read(store, qset, &flw, to, want, nowait);
+		if (n < 0)
+			break;
+		done += n;
+		if ((size_t)n < want)
+			break;
+		__scull_follow_next(&flw);
+		qset = xa_load(&store->qsets, flw.qset_p);
+	}
+	if (done == 0 && count != 0)
+		return (n < 0 ? n : -EFAULT);
+	*f_pos += done;
+	return (done);
+}
+
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct	scull_dev 	*dev = iocb->ki_filp->private_data;
+	struct	scull_store	*store;
+	ssize_t	ssret;
+	int	idx;
+
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	ssret = __scull_read(store, to, &iocb->ki_pos,
+			iocb->ki_flags & IOCB_NOWAIT);
+	srcu_read_unlock(&scull_srcu, idx);
+	return (ssret);
+}
+
+/*
+ * whether slot can be written to without allocating, unsharing or
+ * reading anything back first
+ */
+static bool __scull_quantum_ready(struct scull_store *store,
+		void __rcu **slot)
+{
+	void *quantum = rcu_access_pointer(*slot);
+
+	return (quantum != NULL && !scull_slot_tagged(quantum) &&
+	    !(READ_ONCE(store->shared) && scull_quantum_shared(quantum)));
+}
+
+/*
+ * copy count bytes from from into qset, starting at flw; count must not
+ * go past the qset. With nowait only quanta that are ready are written to,
+ * the first other one ends the copy with -EAGAIN
+ */
+static ssize_t __scull_qset_write(struct scull_store *store,
+		struct scull_qset *qset, struct scull_follow *flw,
+		struct iov_iter *from, size_t count, bool nowait)
+	__must_hold(&qset->lock)
+{
+	struct	scull_retire	*retire = NULL;
+	ssize_t	err = 0, n;
+	size_t	chunk, done;
+	void	*quantum;
 
-	if (__mutex_lock_interruptible_sparse(&dev->lock))
-		return(-ERESTARTSYS);
+	lockdep_assert_held(&qset->lock);
+
+	scull_qset_touch(qset);
+	for (done = 0; done < count; flw->quantum_p++, flw->offset_p = 0) {
+		chunk = min(count - done, store->quantum_len - flw->offset_p);
+		if (nowait && !__scull_quantum_ready(store,
+		    &qset->data[flw->quantum_p])) {
+			err = -EAGAIN;
+			break;
+		}
+		/* zero and duplicate quanta, see dedup.c */
+		if (chunk == store->quantum_len && scull_store_slab(store) &&
+		    !nowait) {
+			n = __scull_quantum_write_whole(store, qset, flw, from,
+					&retire);
+			if (n < 0) {
+				err = n;
+				break;
+			}
+			done += n;
+			if ((size_t)n < chunk) {
+				err = -EFAULT;
+				break;
+			}
+			continue;
+		}
+
+		quantum = __scull_quantum_load(store,
+				&qset->data[flw->quantum_p]);
+		if (IS_ERR(quantum)) {
+			err = PTR_ERR(quantum);
+			break;
+		}
+		if (quantum == NULL) {
+			quantum = scull_quantum_alloc_at(store, qset,
+					flw->quantum_p);
+			if (quantum == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+			/* page faults fill holes without the qset lock */
+			quantum = __scull_quantum_install(store,
+					&qset->data[flw->quantum_p], quantum);
+		} else if (READ_ONCE(store->shared)) {
+			quantum = __scull_quantum_unshare(store,
+					&qset->data[flw->quantum_p]);
+			if (IS_ERR(quantum)) {
+				err = PTR_ERR(quantum);
+				break;
+			}
+		}
 
-	if (*f_pos >= dev->len)
-		goto out;
-	if (*f_pos + count > dev->len)
-		count = dev->len - *f_pos;
+		if (store->dax != NULL)
+			n = scull_dax_copy(quantum + flw->offset_p, chunk,
+					from);
+		else
+			n = copy_from_iter(quantum + flw->offset_p, chunk,
+					from);
+		done += n;
+		if ((size_t)n < chunk) {
+			err = -EFAULT;
+			break;
+		}
+	}
+	if (retire != NULL)
+		scull_retire(retire);
+	if (done == 0)
+		return (err);
+	return (done);
+}
 
-	qset = __scull_follow(dev, &flw, f_pos);
-	if (qset == NULL || qset->data == NULL ||
-	    qset->data[flw.quantum_p] == NULL)
-		goto out;
+/*
+ * give the empty slots among the nr quanta of qset from first on a
+ * quantum, with a single bulk allocation; what the bulk cannot cover is
+ * left to __scull_qset_write()
+ */
+void __scull_qset_fill(struct scull_store *store,
+		struct scull_qset *qset, size_t first, size_t nr, void **quanta)
+	__must_hold(&qset->lock)
+{
+	size_t	i, n, holes = 0;
+	void	*quantum;
 
-	/* read only up to the end of this quantum */
-	if (count > (dev->quantum_len - flw.offset_p))
-		count = dev->quantum_len - flw.offset_p;
+	lockdep_assert_held(&qset->lock);
 
-	if (copy_to_user(buf, qset->data[flw.quantum_p] + flw.offset_p, count)) {
-		ssret = -EFAULT;
-		goto out;
+	for (i = first; i < first + nr; i++)
+		if (rcu_access_pointer(qset->data[i]) == NULL)
+			holes++;
+	if (holes == 0)
+		return;
+	/* the frames are there already, nothing to batch */
+	if (store->dax != NULL) {
+		for (i = first; i < first + nr; i++) {
+			if (rcu_access_pointer(qset->data[i]) != NULL)
+				continue;
+			quantum = scull_quantum_alloc_at(store, qset, i);
+			if (quantum == NULL)
+				return;
+			__scull_quantum_install(store, &qset->data[i],
+					quantum);
+		}
+		return;
 	}
-	*f_pos += count;
-	ssret = count;
-out:
-	__scull_meminfo(dev);
-	__mutex_unlock_sparse(&dev->lock);
-	return (ssret);
+
+	n = scull_quantum_alloc_bulk(store, GFP_KERNEL, holes, quanta);
+	for (i = first; i < first + nr && n != 0; i++)
+		if (rcu_access_pointer(qset->data[i]) == NULL)
+			__scull_quantum_install(store, &qset->data[i],
+					quanta[--n]);
+	/* slots filled by a page fault in the meantime */
+	while (n != 0)
+		scull_quantum_free(store, quanta[--n]);
+}
+
+/*
+ * create the qsets from first to last that do not exist yet; a failure
+ * is left to the write loop to report
+ */
+void __scull_qsets_reserve(struct scull_store *store,
+		unsigned long first, unsigned long last)
+{
+	unsigned long idx;
+
+	for (idx = first; idx <= last; idx++)
+		if (xa_load(&store->qsets, idx) == NULL &&
+		    __scull_qset_alloc(store, idx) == NULL)
+			return;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-		loff_t *f_pos)
+/*
+ * writers share the device lock, which only keeps a trim away; they
+ * serialize on the lock of each qset they write to
+ *
+ * a write covering SCULL_BULK quanta or more reserves its qsets up
+ * front; unless its quanta come from a slab, it fills each qset with one
+ * bulk allocation
+ *
+ * a nowait write (IOCB_NOWAIT) neither sleeps on a qset lock nor
+ * allocates: it stops with -EAGAIN where it would, and is retried
+ * from there by a context that can block
+ */
+ssize_t __scull_write(struct scull_dev *dev, struct scull_store *store,
+		struct iov_iter *from, loff_t *f_pos, bool nowait)
+	__must_hold(&dev->lock)
 {
-	struct	scull_dev 	*dev = filp->private_data;
+	const	size_t	count = iov_iter_count(from);
 	struct	scull_qset 	*qset;
 	struct	scull_follow	 flw;
-	ssize_t ssret = -ENOMEM;
+	size_t	want, done = 0;
+	void	**quanta = NULL;
+	ssize_t	n = 0;
 
-	if (__mutex_lock_interruptible_sparse(&dev->lock))
-		return (-ERESTARTSYS);
+	lockdep_assert_held(&dev->lock);
 
-	qset = __scull_follow(dev, &flw, f_pos);
-	if (qset == NULL)
-		goto out;
-	if (qset->data == NULL) {
-		qset->data = kcalloc(dev->qset_len, sizeof(*qset->data),
-				GFP_KERNEL);
-		if (qset->data == NULL)
-			goto out;
+	/* a pmem backed device ends with its region */
+	if (store->dax != NULL && count != 0 &&
+	    *f_pos + count > scull_dax_size(store->dax))
+		return (-ENOSPC);
+	/* over the limit, and the backing file is full */
+	if (count != 0 && scull_spill_full(store))
+		return (-ENOSPC);
+	qset = __scull_follow(store, &flw, f_pos);
+	if (count >= SCULL_BULK * store->quantum_len && !nowait) {
+		/*
+		 * slab quanta written whole may turn out zero or duplicate
+		 * (dedup.c), only what is kept is allocated; the partial
+		 * ones at both ends are not worth a bulk
+		 */
+		if (!scull_store_slab(store))
+			quanta = kmalloc_array(min(store->qset_len,
+					DIV_ROUND_UP(count,
+					store->quantum_len) + 1),
+					sizeof(*quanta), GFP_KERNEL);
+		__scull_qsets_reserve(store, flw.qset_p, (*f_pos + count - 1) /
+				(store->quantum_len * store->qset_len));
+		if (qset == NULL)
+			qset = xa_load(&store->qsets, flw.qset_p);
 	}
-	if (qset->data[flw.quantum_p] == NULL) {
-		qset->data[flw.quantum_p] = kmem_cache_alloc(kmc, GFP_KERNEL);
-		if (qset->data[flw.quantum_p] == NULL)
-			goto out;
+	while (done < count) {
+		if (qset == NULL && nowait) {
+			n = -EAGAIN;
+			break;
+		}
+		if (qset == NULL)
+			qset = __scull_qset_alloc(store, flw.qset_p);
+		if (qset == NULL) {
+			n = -ENOMEM;
+			break;
+		}
+		if (nowait) {
+			if (!__mutex_trylock_sparse(&qset->lock)) {
+				n = -EAGAIN;
+				break;
+			}
+		} else if (__mutex_lock_interruptible_sparse(&qset->lock)) {
+			n = -ERESTARTSYS;
+			break;
+		}
+		want = min(count - done, __scull_qset_left(store, &flw));
+		if (quanta != NULL)
+			__scull_qset_fill(store, qset, flw.quantum_p,
+					DIV_ROUND_UP(flw.offset_p + want,
+					store->quantum_len), quanta);
+		n = __scull_qset_write(store, qset, &flw, from, want, nowait);
+		__mutex_unlock_sparse(&qset->lock);
+		if (n < 0)
+			break;
+		done += n;
+		if ((size_t)n < want)
+			break;
+		__scull_follow_next(&flw);
+		qset = xa_load(&store->qsets, flw.qset_p);
 	}
+	kfree(quanta);
+	if (done == 0)
+		return (n);
+
+	*f_pos += done;
+	/* what went to pmem is there once the write returns */
+	if (store->dax != NULL)
+		scull_dax_flush(store->dax);
+	/* update size */
+	__scull_store_extend(store, *f_pos);
+	return (done);
+}
 
-	/* write only up to the end of this quantum */
-	if (count > (dev->quantum_len - flw.offset_p))
-		count = dev->quantum_len - flw.offset_p;
+/*
+ * O_APPEND: the range is reserved past the data and the appends still in
+ * flight, under the same lock as the length, then written like any
+ * other; concurrent appenders only meet on the qsets they share.
+ *
+ * The length only covers a range once it and every range reserved before
+ * it are written, a reader tailing the device never sees a range still
+ * being filled: appends, and other writes past the first range in
+ * flight, that finish early wait in pending. An append
+ * that fails gives its range back unless another one was reserved after
+ * it, then it is left as a hole
+ */
+static ssize_t __scull_append(struct scull_dev *dev,
+		struct scull_store *store, struct iov_iter *from,
+		loff_t *f_pos, bool nowait)
+	__must_hold(&dev->lock)
+{
+	const	size_t	count = iov_iter_count(from);
+	struct	scull_append	 ap;
+	loff_t	pos;
+	ssize_t	n;
 
-	if (copy_from_user(qset->data[flw.quantum_p] + flw.offset_p, buf,
-				count)) {
-		ssret = -EFAULT;
-		goto out;
+	xa_lock(&store->qsets);
+	ap.start = max(store->tail, store->len);
+	if (count > MAX_LFS_FILESIZE - ap.start) {
+		xa_unlock(&store->qsets);
+		return (-EFBIG);
 	}
-	*f_pos += count;
-	ssret = count;
+	store->tail = ap.start + count;
+	/* reserved in order, the list stays sorted */
+	list_add_tail(&ap.list, &store->appends);
+	xa_unlock(&store->qsets);
 
-	/* update size */
-	if (dev->len < *f_pos)
-		dev->len = *f_pos;
+	pos = ap.start;
+	n = __scull_write(dev, store, from, &pos, nowait);
+
+	xa_lock(&store->qsets);
+	if ((n < 0 || (size_t)n < count) && store->tail == ap.start + count)
+		store->tail = ap.start + max_t(ssize_t, n, 0);
+	list_del(&ap.list);
+	__scull_store_settle(store, n > 0 ? (size_t)pos : 0);
+	xa_unlock(&store->qsets);
+	if (n > 0)
+		*f_pos = pos;
+	return (n);
+}
+
+/*
+ * a write ending past the first quantum of a compact store first gives
+ * the device its full geometry; called and returns with dev->lock
+ * read-held, and the store to write to
+ */
+struct scull_store *__scull_store_grow(struct scull_dev *dev,
+		struct scull_store *store, loff_t end)
+	__must_hold(&dev->lock)
+{
+
+	if (!store->compact || end <= (loff_t)store->quantum_len)
+		return (store);
+	/*
+	 * a mapped device stays compact, it still works; the grow would
+	 * only fail with -EBUSY after taking the lock for writing
+	 */
+	if (store->pages && atomic_read(&dev->maps) > 0)
+		return (store);
+	__up_read_sparse(&dev->lock);
+	scull_grow(dev);
+	__down_read_sparse(&dev->lock);
+	return (scull_store_locked(dev));
+}
+
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	const	bool	nowait = iocb->ki_flags & IOCB_NOWAIT;
+	struct	scull_dev 	*dev = iocb->ki_filp->private_data;
+	struct	scull_store	*store;
+	ssize_t ssret;
+
+	if (nowait) {
+		if (!__down_read_trylock_sparse(&dev->lock))
+			return (-EAGAIN);
+	} else if (__down_read_killable_sparse(&dev->lock)) {
+		return (-ERESTARTSYS);
+	}
 
-out:
-	__scull_meminfo(dev);
-	__mutex_unlock_sparse(&dev->lock);
+	store = scull_store_locked(dev);
+	if (!nowait)
+		store = __scull_store_grow(dev, store,
+				(iocb->ki_flags & IOCB_APPEND ?
+				READ_ONCE(store->len) : iocb->ki_pos) +
+				iov_iter_count(from));
+	if (iocb->ki_flags & IOCB_APPEND)
+		ssret = __scull_append(dev, store, from, &iocb->ki_pos, nowait);
+	else
+		ssret = __scull_write(dev, store, from, &iocb->ki_pos, nowait);
+	scull_spill_check(store);
+	__up_read_sparse(&dev->lock);
 	return (ssret);
 }
 
@@ -244,18 +1011,32 @@ void scull_cleanup_module(void)
 	if (scull_devices == NULL)
 		goto final;
 
+	scull_blk_cleanup();
+	scull_compress_cleanup();
 	for (i = 0; i < scull_nr_devs; i++) {
-		struct scull_dev *dev = &scull_devices[i];
-
-		__mutex_lock_sparse(&dev->lock);
-		__scull_trim(dev);
-		__mutex_unlock_sparse(&dev->lock);
-		cdev_del(&dev->cdev);
+		cdev_del(&scull_devices[i].cdev);
+		scull_spill_cancel(&scull_devices[i]);
 	}
-	kfree(scull_devices);
 
-	if (kmc != NULL)
-		kmem_cache_destroy(kmc);
+	/*
+	 * wait for the trimmed stores, whose free may still look at the
+	 * live one of their device
+	 */
+	srcu_barrier(&scull_srcu);
+	if (scull_wq != NULL)
+		flush_workqueue(scull_wq);
+	/* no opener left, hence no reader either */
+	for (i = 0; i < scull_nr_devs; i++)
+		scull_store_free(rcu_dereference_protected(
+				scull_devices[i].store, 1));
+	if (scull_wq != NULL)
+		destroy_workqueue(scull_wq);
+	/* their spilled quanta gave back the file space */
+	for (i = 0; i < scull_nr_devs; i++)
+		scull_spill_destroy(&scull_devices[i]);
+	scull_dax_cleanup();
+	kfree(scull_devices);
+	scull_quantum_cleanup();
 final:
 	scull_remove_proc();
 
@@ -306,20 +1087,41 @@ int scull_init_module(void)
 		goto fail;
 	}
 
-	kmc = kmem_cache_create("scull_kmem", scull_quantum, 0,
-	    SLAB_HWCACHE_ALIGN | SLAB_RED_ZONE, NULL);
-	if (kmc == NULL) {
+	scull_wq = alloc_workqueue("scull", WQ_UNBOUND, 0);
+	if (scull_wq == NULL) {
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	ret = scull_quantum_init();
+	if (ret)
+		goto fail;
+
 	/* initialize each device */
 	for (i = 0; i < scull_nr_devs; i++) {
-		scull_devices[i].quantum_len = scull_quantum;
-		scull_devices[i].qset_len = scull_qset;
-		mutex_init(&scull_devices[i].lock);
-		scull_setup_cdev(&scull_devices[i], i);
+		struct scull_store *store;
+
+		scull_devices[i].node = NUMA_NO_NODE;
+		store = scull_store_alloc(&scull_devices[i]);
+		if (store == NULL) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		RCU_INIT_POINTER(scull_devices[i].store, store);
+		init_rwsem(&scull_devices[i].lock);
 	}
+	/* the contents are in place before anyone can open a device */
+	scull_dax_init();
+	scull_ckpt_restore();
+	for (i = 0; i < scull_nr_devs; i++)
+		scull_setup_cdev(&scull_devices[i], i);
+	/* scans the devices */
+	ret = scull_compress_init();
+	if (ret)
+		goto fail;
+	ret = scull_blk_init();
+	if (ret)
+		goto fail;
 
 	dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
 	dev += scull_p_init(dev); 
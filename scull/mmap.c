@@ -0,0 +1,110 @@
+#include <linux/mm.h>
+
+#include "scull.h"
+
+/*
+ * faults never take the device or the qset locks: a process may write()
+ * to the device from a buffer mapped from the very same device, while
+ * the writer holds both.
+ *
+ * Holes are filled like a writer would, the slot is claimed with a
+ * cmpxchg. A store retired by a trim in the meantime only goes away
+ * after this SRCU section, and the reference taken on the page keeps it
+ * mapped after that.
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+	struct	scull_dev	*dev = vmf->vma->vm_private_data;
+	const	loff_t	pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+	struct	scull_store	*store;
+	struct	scull_qset	*qset;
+	struct	scull_follow	 flw;
+	void	*quantum;
+	vm_fault_t	ret = VM_FAULT_SIGBUS;
+	int	idx;
+
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	/* nothing is mapped past the end of the device */
+	if (!store->pages || pos >= smp_load_acquire(&store->len))
+		goto out;
+
+	ret = VM_FAULT_OOM;
+	qset = __scull_follow(store, &flw, &pos);
+	if (qset == NULL)
+		qset = __scull_qset_alloc(store, flw.qset_p);
+	if (qset == NULL)
+		goto out;
+
+	quantum = srcu_dereference(qset->data[flw.quantum_p], &scull_srcu);
+	/* a writable mapping never reaches a quantum of a snapshot */
+	if (quantum != NULL && (vmf->vma->vm_flags & VM_MAYWRITE) &&
+	    READ_ONCE(store->shared)) {
+		quantum = __scull_quantum_unshare(store,
+				&qset->data[flw.quantum_p]);
+		if (IS_ERR(quantum))
+			goto out;
+	}
+	if (quantum == NULL) {
+		quantum = scull_quantum_alloc(store, GFP_KERNEL);
+		if (quantum == NULL)
+			goto out;
+		quantum = __scull_quantum_install(store,
+				&qset->data[flw.quantum_p], quantum);
+	}
+
+	vmf->page = virt_to_page(quantum + flw.offset_p);
+	get_page(vmf->page);
+	ret = 0;
+out:
+	srcu_read_unlock(&scull_srcu, idx);
+	return (ret);
+}
+
+/*
+ * vmas are counted so that a snapshot does not share quanta that are
+ * mapped already, see scull_snapshot()
+ */
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->maps);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->maps);
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+	.open =		scull_vma_open,
+	.close =	scull_vma_close,
+	.fault =	scull_vma_fault,
+};
+
+/*
+ * only devices with page backed quanta (scull_pages) can be mapped, and
+ * not while a snapshot of them is taken
+ */
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct	scull_dev	*dev = filp->private_data;
+	bool	pages;
+	int	idx;
+
+	idx = srcu_read_lock(&scull_srcu);
+	pages = srcu_dereference(dev->store, &scull_srcu)->pages;
+	srcu_read_unlock(&scull_srcu, idx);
+	if (!pages)
+		return (-ENODEV);
+	if (!atomic_inc_unless_negative(&dev->maps))
+		return (-EBUSY);
+
+	vma->vm_ops = &scull_vm_ops;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = dev;
+	return (0);
+}
@@ -15,6 +15,16 @@ static inline int __mutex_lock_interruptible_sparse(struct mutex *lock)
 	return (ret);
 }
 
+static inline int __mutex_trylock_sparse(struct mutex *lock)
+	__acquires(lock)
+{
+	int ret = mutex_trylock(lock);
+	if (ret)
+		__acquire(lock);
+
+	return (ret);
+}
+
 static inline void __mutex_lock_sparse(struct mutex *lock)
 	__acquires(lock)
 {
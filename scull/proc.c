@@ -1,8 +1,9 @@
 #include <linux/ctype.h>
+#include <linux/nodemask.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 
-#include "mutex_sparse.h"
+#include "rwsem_sparse.h"
 #include "scull.h"
 
 static void *scull_seq_start(struct seq_file *s, loff_t *pos)
@@ -41,28 +42,44 @@ static void __scull_print_ascii(struct seq_file *s, void *data, size_t data_len)
 static int scull_seq_show(struct seq_file *s, void *v)
 {
 	struct scull_dev	*dev = (struct scull_dev *)v;
+	struct	scull_store	*store;
 	const 	struct scull_qset 	*qset;
+	unsigned long	idx, last;
+	void	*quantum;
 	size_t 	i;
 
-	if (__mutex_lock_interruptible_sparse(&dev->lock))
+	/* keep writers away while the quanta are dumped */
+	if (__down_write_killable_sparse(&dev->lock))
 		return(-ERESTARTSYS);
+	store = scull_store_locked(dev);
 	seq_printf(s, "\ndevice %zu: qset %zu, q %zu, sz %zu\n",
-			(size_t) (dev - scull_devices), dev->qset_len,
-			dev->quantum_len, dev->len);
-	for (qset = dev->qset; qset != NULL; qset = qset->next) {
-		seq_printf(s, "  item at %p, qset at %p\n", qset, qset->data);
-		if (qset->data != NULL && qset->next == NULL)
-			for (i = 0; i < dev->qset_len; i++) {
-				if (qset->data[i] != NULL) {
-					seq_printf(s, "    %4zd: %8p\n",
-							i, qset->data[i]);
-					__scull_print_ascii(s, qset->data[i],
-							dev->len);
-
-				}
+			(size_t) (dev - scull_devices), store->qset_len,
+			store->quantum_len, store->len);
+	xa_for_each(&store->qsets, idx, qset) {
+		seq_printf(s, "  item %lu at %p, qset at %p\n", idx, qset,
+				qset->data);
+		/* only dump the last qset */
+		last = idx;
+		if (xa_find_after(&store->qsets, &last,
+		    ULONG_MAX, XA_PRESENT) != NULL)
+			continue;
+		for (i = 0; i < store->qset_len; i++) {
+			quantum = rcu_dereference_protected(qset->data[i],
+					lockdep_is_held(&dev->lock));
+			if (scull_slot_compressed(quantum)) {
+				seq_printf(s, "    %4zd: compressed\n", i);
+			} else if (scull_slot_spilled(quantum)) {
+				seq_printf(s, "    %4zd: spilled\n", i);
+			} else if (quantum != NULL) {
+				seq_printf(s, "    %4zd: %8p\n", i, quantum);
+				/* quanta may be smaller than the dump */
+				__scull_print_ascii(s, quantum,
+						min(store->len,
+						store->quantum_len));
 			}
+		}
 	}
-	__mutex_unlock_sparse(&dev->lock);
+	__up_write_sparse(&dev->lock);
 	return (0);
 }
 
@@ -72,6 +89,72 @@ static void scull_seq_stop(struct seq_file *s, void *v)
 	return;
 }
 
+/*
+ * memory accounting of every device; only reads the store counters
+ */
+static int scull_stat_show(struct seq_file *s, void *v)
+{
+	struct	scull_store	*store;
+	size_t	i, quanta, qsets;
+	int	idx;
+
+	seq_printf(s, "dev len quanta quanta_bytes qsets array_bytes "
+			"slab_overhead zquanta zbytes spilled\n");
+	idx = srcu_read_lock(&scull_srcu);
+	for (i = 0; i < scull_nr_devs; i++) {
+		store = srcu_dereference(scull_devices[i].store, &scull_srcu);
+		quanta = atomic_long_read(&store->stats.quanta);
+		qsets = atomic_long_read(&store->stats.qsets);
+		seq_printf(s, "%zu %zu %zu %zu %zu %zu %zu %ld %ld %ld\n", i,
+				READ_ONCE(store->len), quanta,
+				quanta * store->quantum_len, qsets,
+				qsets * (sizeof(struct scull_qset) +
+				store->qset_len * sizeof(void *)),
+				quanta * (scull_quantum_footprint(store) -
+				store->quantum_len),
+				atomic_long_read(&store->stats.zquanta),
+				atomic_long_read(&store->stats.zbytes),
+				atomic_long_read(&store->stats.spilled));
+	}
+	srcu_read_unlock(&scull_srcu, idx);
+	return (0);
+}
+
+/*
+ * placement policy and quanta per node of every device
+ */
+static int scull_node_show(struct seq_file *s, void *v)
+{
+	static	const	char	* const policies[] = {
+		[SCULL_PLACE_LOCAL] =		"local",
+		[SCULL_PLACE_INTERLEAVE] =	"interleave",
+		[SCULL_PLACE_BIND] =		"bind",
+	};
+	struct	scull_store	*store;
+	size_t	i;
+	u32	policy;
+	int	idx, node;
+
+	seq_printf(s, "dev policy");
+	for_each_node(node)
+		seq_printf(s, " node%d", node);
+	seq_printf(s, "\n");
+	idx = srcu_read_lock(&scull_srcu);
+	for (i = 0; i < scull_nr_devs; i++) {
+		store = srcu_dereference(scull_devices[i].store, &scull_srcu);
+		policy = READ_ONCE(store->policy);
+		seq_printf(s, "%zu %s", i, policies[policy]);
+		if (policy == SCULL_PLACE_BIND)
+			seq_printf(s, ":%d", READ_ONCE(store->node));
+		for_each_node(node)
+			seq_printf(s, " %ld",
+					atomic_long_read(&store->stats.nodes[node]));
+		seq_printf(s, "\n");
+	}
+	srcu_read_unlock(&scull_srcu, idx);
+	return (0);
+}
+
 static struct seq_operations scull_seq_ops = {
 	.start = scull_seq_start,
 	.next  = scull_seq_next,
@@ -96,11 +179,15 @@ static struct proc_ops scullseq_proc_ops = {
 void scull_create_proc(void)
 {
 	proc_create("scullmem", 0, NULL, &scullseq_proc_ops);
+	proc_create_single("scullstat", 0, NULL, scull_stat_show);
+	proc_create_single("scullnodes", 0, NULL, scull_node_show);
 }
 
 void scull_remove_proc(void)
 {
 	remove_proc_entry("scullmem", NULL);
+	remove_proc_entry("scullstat", NULL);
+	remove_proc_entry("scullnodes", NULL);
 	return;
 }
 
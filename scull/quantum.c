@@ -0,0 +1,613 @@
+#include <linux/gfp.h>
+#include <linux/io.h>
+#include <linux/mempool.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "scull.h"
+
+/* red zoning costs every allocation, keep it for debug builds */
+#ifdef SCULL_DEBUG
+#define SCULL_SLAB_FLAGS	(SLAB_HWCACHE_ALIGN | SLAB_RED_ZONE)
+#else
+#define SCULL_SLAB_FLAGS	(SLAB_HWCACHE_ALIGN)
+#endif
+
+/* quanta kept aside for allocations under memory pressure */
+static uint scull_reserve;
+module_param(scull_reserve, uint, S_IRUGO);
+
+/* size classes of slab quanta: 32, 48, 64, 96, ... */
+#ifndef SCULL_NR_CLASSES
+#define SCULL_NR_CLASSES	32
+#endif
+
+/*
+ * quanta owned by more than one store (snapshots), by physical address;
+ * the value is the number of extra owners, no entry means one owner
+ */
+static DEFINE_XARRAY(scull_shares);
+
+/*
+ * per cpu stack of slab quanta; the write path pops from it with
+ * preemption disabled, work refills it in the background and freed
+ * quanta are pushed back while there is room
+ */
+struct scull_magazine {
+	struct	scull_cache	*cache;
+	struct	work_struct	work;
+	size_t	nr;
+	void	*quanta[SCULL_MAGAZINE];
+};
+
+/*
+ * slab quanta come from one cache per size class, created when a store
+ * first needs it; each class has its own magazines and reserve
+ */
+struct scull_cache {
+	struct	kmem_cache	*kmc;
+	mempool_t		*pool;
+	struct	scull_magazine	__percpu *mags;
+	size_t			size;	/* of an object in its slab */
+};
+
+static struct scull_cache *scull_caches[SCULL_NR_CLASSES];
+static DEFINE_MUTEX(scull_caches_lock);
+
+static void scull_mag_refill(struct work_struct *work)
+{
+	struct	scull_cache	*cache;
+	struct	scull_magazine	*mag;
+	void	*quanta[SCULL_MAGAZINE];
+	size_t	i, nr;
+
+	cache = container_of(work, struct scull_magazine, work)->cache;
+	mag = get_cpu_ptr(cache->mags);
+	nr = SCULL_MAGAZINE - mag->nr;
+	put_cpu_ptr(cache->mags);
+	if (nr == 0)
+		return;
+
+	nr = kmem_cache_alloc_bulk(cache->kmc, GFP_KERNEL | __GFP_NOWARN, nr,
+			quanta);
+	/* we may have run on another cpu, or been raced by a free */
+	mag = get_cpu_ptr(cache->mags);
+	for (i = 0; i < nr && mag->nr < SCULL_MAGAZINE; i++)
+		mag->quanta[mag->nr++] = quanta[i];
+	put_cpu_ptr(cache->mags);
+	if (i < nr)
+		kmem_cache_free_bulk(cache->kmc, nr - i, quanta + i);
+}
+
+static void *scull_mag_pop(struct scull_cache *cache)
+{
+	struct	scull_magazine	*mag;
+	void	*quantum = NULL;
+
+	mag = get_cpu_ptr(cache->mags);
+	if (mag->nr)
+		quantum = mag->quanta[--mag->nr];
+	if (mag->nr < SCULL_MAGAZINE / 2)
+		queue_work_on(smp_processor_id(), system_wq, &mag->work);
+	put_cpu_ptr(cache->mags);
+	return (quantum);
+}
+
+static bool scull_mag_push(struct scull_cache *cache, void *quantum)
+{
+	struct	scull_magazine	*mag;
+	bool	pushed = false;
+
+	mag = get_cpu_ptr(cache->mags);
+	if (mag->nr < SCULL_MAGAZINE) {
+		mag->quanta[mag->nr++] = quantum;
+		pushed = true;
+	}
+	put_cpu_ptr(cache->mags);
+	return (pushed);
+}
+
+/*
+ * magazine first, it holds quanta of the local node; with a reserve, the
+ * slab gets one cheap attempt before the reserve is used, so that writers
+ * do not stall in reclaim
+ */
+static void *scull_slab_alloc(struct scull_cache *cache, gfp_t gfp, int node)
+{
+	void *quantum = NULL;
+
+	if (node == NUMA_NO_NODE || node == numa_node_id())
+		quantum = scull_mag_pop(cache);
+	if (quantum == NULL && cache->pool != NULL) {
+		quantum = kmem_cache_alloc_node(cache->kmc,
+				gfp | __GFP_NORETRY | __GFP_NOWARN, node);
+		if (quantum == NULL)
+			quantum = mempool_alloc(cache->pool, GFP_NOWAIT);
+	}
+	if (quantum == NULL)
+		quantum = kmem_cache_alloc_node(cache->kmc, gfp, node);
+	if (quantum != NULL)
+		memset(quantum, 0, kmem_cache_size(cache->kmc));
+	return (quantum);
+}
+
+/*
+ * a depleted reserve is refilled first, then the magazine with quanta of
+ * the local node
+ */
+static void scull_slab_free(struct scull_cache *cache, void *quantum)
+{
+	mempool_t *pool = cache->pool;
+
+	if (pool != NULL && READ_ONCE(pool->curr_nr) < pool->min_nr)
+		mempool_free(quantum, pool);
+	else if (page_to_nid(virt_to_page(quantum)) != numa_node_id() ||
+	    !scull_mag_push(cache, quantum))
+		kmem_cache_free(cache->kmc, quantum);
+}
+
+static size_t scull_class_size(unsigned int class)
+{
+
+	return ((size_t)(class & 1 ? 48 : 32) << (class / 2));
+}
+
+static void scull_cache_destroy(struct scull_cache *cache)
+{
+	struct	scull_magazine	*mag;
+	int	cpu;
+
+	if (cache == NULL)
+		return;
+	if (cache->mags != NULL) {
+		for_each_possible_cpu(cpu) {
+			mag = per_cpu_ptr(cache->mags, cpu);
+			cancel_work_sync(&mag->work);
+			kmem_cache_free_bulk(cache->kmc, mag->nr, mag->quanta);
+		}
+		free_percpu(cache->mags);
+	}
+	mempool_destroy(cache->pool);
+	kmem_cache_destroy(cache->kmc);
+	kfree(cache);
+}
+
+static struct scull_cache *scull_cache_create(size_t size)
+{
+	struct	scull_magazine	*mag;
+	struct	scull_cache	*cache;
+	char	name[32];
+	void	*obj;
+	int	cpu;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (cache == NULL)
+		return (NULL);
+	/* the name is copied */
+	snprintf(name, sizeof(name), "scull_%zu", size);
+	cache->kmc = kmem_cache_create(name, size, 0, SCULL_SLAB_FLAGS, NULL);
+	if (cache->kmc == NULL)
+		goto fail;
+	/* kmem_cache_size() is the object size, not what it takes */
+	obj = kmem_cache_alloc(cache->kmc, GFP_KERNEL);
+	if (obj == NULL)
+		goto fail;
+	cache->size = ksize(obj);
+	kmem_cache_free(cache->kmc, obj);
+	if (scull_reserve) {
+		cache->pool = mempool_create_slab_pool(scull_reserve,
+				cache->kmc);
+		if (cache->pool == NULL)
+			goto fail;
+	}
+	cache->mags = alloc_percpu(struct scull_magazine);
+	if (cache->mags == NULL)
+		goto fail;
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(cache->mags, cpu);
+		mag->cache = cache;
+		INIT_WORK(&mag->work, scull_mag_refill);
+	}
+	for_each_online_cpu(cpu)
+		queue_work_on(cpu, system_wq,
+				&per_cpu_ptr(cache->mags, cpu)->work);
+	return (cache);
+fail:
+	scull_cache_destroy(cache);
+	return (NULL);
+}
+
+/*
+ * the cache of the smallest class that holds a quantum of size bytes,
+ * created on first use; stores keep it for their lifetime
+ */
+struct scull_cache *scull_quantum_cache(size_t size)
+{
+	struct	scull_cache	*cache;
+	unsigned int	class;
+
+	for (class = 0; class < SCULL_NR_CLASSES; class++)
+		if (scull_class_size(class) >= size)
+			break;
+	if (size == 0 || class == SCULL_NR_CLASSES)
+		return (ERR_PTR(-EINVAL));
+
+	/* published complete */
+	cache = smp_load_acquire(&scull_caches[class]);
+	if (cache != NULL)
+		return (cache);
+
+	mutex_lock(&scull_caches_lock);
+	cache = scull_caches[class];
+	if (cache == NULL) {
+		cache = scull_cache_create(scull_class_size(class));
+		if (cache != NULL)
+			smp_store_release(&scull_caches[class], cache);
+	}
+	mutex_unlock(&scull_caches_lock);
+	if (cache == NULL)
+		return (ERR_PTR(-ENOMEM));
+	return (cache);
+}
+
+/*
+ * node the next quantum of store should come from, NUMA_NO_NODE for the
+ * local one. Interleaving writers race for the rotor, an uneven turn now
+ * and then does not matter
+ */
+static int scull_quantum_node(struct scull_store *store)
+{
+	int node;
+
+	switch (READ_ONCE(store->policy)) {
+	case SCULL_PLACE_INTERLEAVE:
+		node = next_node_in(READ_ONCE(store->rotor),
+				node_states[N_MEMORY]);
+		if (node == MAX_NUMNODES)
+			return (NUMA_NO_NODE);
+		WRITE_ONCE(store->rotor, node);
+		return (node);
+	case SCULL_PLACE_BIND:
+		/* a preference: the allocator falls back when it is full */
+		node = READ_ONCE(store->node);
+		if (!node_state(node, N_MEMORY))
+			return (NUMA_NO_NODE);
+		return (node);
+	default:
+		return (NUMA_NO_NODE);
+	}
+}
+
+/*
+ * one more (delta 1) or one less (-1) quantum in store, on the node of
+ * its memory; persistent memory is not on any
+ */
+void scull_quantum_account(struct scull_store *store, void *quantum,
+		long delta)
+{
+
+	atomic_long_add(delta, &store->stats.quanta);
+	if (store->dax == NULL)
+		atomic_long_add(delta, &store->stats.nodes[
+				page_to_nid(virt_to_page(quantum))]);
+}
+
+/*
+ * quanta are zeroed: lockless readers may reach one before the writer
+ * has filled it.
+ *
+ * Page backed quanta are split, so every page of a quantum can be mapped
+ * and referenced on its own (see mmap.c).
+ */
+void *scull_quantum_alloc(struct scull_store *store, gfp_t gfp)
+{
+	const int node = scull_quantum_node(store);
+	struct page *page;
+	unsigned int order;
+	void *quantum;
+
+	/* frames only come with their position */
+	if (WARN_ON_ONCE(store->dax != NULL))
+		return (NULL);
+	if (!store->pages) {
+		quantum = scull_slab_alloc(store->cache, gfp, node);
+		if (quantum != NULL)
+			scull_quantum_account(store, quantum, 1);
+		return (quantum);
+	}
+
+	order = get_order(store->quantum_len);
+	page = alloc_pages_node(node, gfp | __GFP_ZERO, order);
+	if (page == NULL)
+		return (NULL);
+	if (order)
+		split_page(page, order);
+	quantum = page_address(page);
+	scull_quantum_account(store, quantum, 1);
+	return (quantum);
+}
+
+/*
+ * the quantum for slot i of qset, the frame of that position for a store
+ * backed by persistent memory (see dax.c)
+ */
+void *scull_quantum_alloc_at(struct scull_store *store,
+		struct scull_qset *qset, size_t i)
+{
+
+	if (store->dax != NULL)
+		return (scull_dax_claim(store->dax,
+				qset->idx * store->qset_len + i));
+	return (scull_quantum_alloc(store, GFP_KERNEL));
+}
+
+/*
+ * allocate up to nr quanta at once, returns how many were allocated
+ */
+size_t scull_quantum_alloc_bulk(struct scull_store *store, gfp_t gfp,
+		size_t nr, void **quanta)
+{
+	size_t i;
+
+	/* the slab bulk interface knows no nodes */
+	if (!scull_store_slab(store) ||
+	    READ_ONCE(store->policy) != SCULL_PLACE_LOCAL) {
+		for (i = 0; i < nr; i++) {
+			quanta[i] = scull_quantum_alloc(store, gfp);
+			if (quanta[i] == NULL)
+				break;
+		}
+		return (i);
+	}
+
+	/* a bulk does not go through the magazine, it would drain it */
+	nr = kmem_cache_alloc_bulk(store->cache->kmc, gfp | __GFP_ZERO, nr,
+			quanta);
+	for (i = 0; i < nr; i++)
+		scull_quantum_account(store, quanta[i], 1);
+	return (nr);
+}
+
+static unsigned long scull_share_key(void *quantum)
+{
+
+	return ((unsigned long)virt_to_phys(quantum));
+}
+
+/*
+ * one more store owns quantum
+ */
+int scull_quantum_share(void *quantum)
+{
+	const	unsigned long	key = scull_share_key(quantum);
+	void	*old, *cur;
+
+	xa_lock(&scull_shares);
+	cur = xa_load(&scull_shares, key);
+	do {
+		old = cur;
+		/* may drop the lock to allocate a node */
+		cur = __xa_cmpxchg(&scull_shares, key, old,
+				xa_mk_value(xa_to_value(old) + 1), GFP_KERNEL);
+	} while (cur != old && !xa_is_err(cur));
+	xa_unlock(&scull_shares);
+	return (xa_err(cur));
+}
+
+bool scull_quantum_shared(void *quantum)
+{
+
+	return (xa_load(&scull_shares, scull_share_key(quantum)) != NULL);
+}
+
+/*
+ * drop an owner of quantum, true for the last one
+ */
+static bool scull_quantum_put(void *quantum)
+{
+	const	unsigned long	key = scull_share_key(quantum);
+	unsigned long	n;
+
+	xa_lock(&scull_shares);
+	n = xa_to_value(xa_load(&scull_shares, key));
+	/* existing entries are updated in place, nothing to allocate */
+	if (n > 1)
+		__xa_store(&scull_shares, key, xa_mk_value(n - 1), 0);
+	else if (n == 1)
+		__xa_erase(&scull_shares, key);
+	xa_unlock(&scull_shares);
+	return (n == 0);
+}
+
+/*
+ * pages still mapped by a process are released on their last put_page();
+ * a quantum shared with another store stays with it. No cache means page
+ * backed
+ */
+static void __scull_quantum_release(struct scull_cache *cache,
+		struct scull_spill *spill, size_t quantum_len, void *quantum)
+{
+	struct page *page;
+	size_t i;
+
+	if (scull_slot_compressed(quantum)) {
+		scull_zquantum_free(quantum);
+		return;
+	}
+	if (scull_slot_spilled(quantum)) {
+		scull_spill_free(spill, quantum_len, quantum);
+		return;
+	}
+	if (!scull_quantum_put(quantum))
+		return;
+	if (cache != NULL) {
+		scull_slab_free(cache, quantum);
+		return;
+	}
+
+	page = virt_to_page(quantum);
+	for (i = 0; i < quantum_len >> PAGE_SHIFT; i++)
+		put_page(page + i);
+}
+
+/*
+ * only for quanta no reader can reach, see scull_retire() otherwise
+ */
+void scull_quantum_free(struct scull_store *store, void *quantum)
+{
+
+	if (quantum == NULL)
+		return;
+	scull_quantum_account(store, quantum, -1);
+	if (store->dax != NULL)
+		scull_dax_unclaim(store->dax, quantum);
+	else
+		__scull_quantum_release(store->cache, store->spill,
+				store->quantum_len, quantum);
+}
+
+/*
+ * quanta may hold NULL entries (holes); only used on a store that is
+ * going away, so its counters are left alone
+ */
+void scull_quantum_free_bulk(struct scull_store *store, size_t nr,
+		void **quanta)
+{
+	size_t i;
+
+	/* frames stay with the region */
+	if (store->dax != NULL)
+		return;
+	if (!store->pages && !store->shared &&
+	    atomic_long_read(&store->stats.zquanta) == 0 &&
+	    atomic_long_read(&store->stats.spilled) == 0) {
+		kmem_cache_free_bulk(store->cache->kmc, nr, quanta);
+		return;
+	}
+	for (i = 0; i < nr; i++)
+		if (quanta[i] != NULL)
+			__scull_quantum_release(store->cache, store->spill,
+					store->quantum_len, quanta[i]);
+}
+
+/*
+ * memory actually taken by one quantum
+ */
+size_t scull_quantum_footprint(const struct scull_store *store)
+{
+
+	if (!scull_store_slab(store))
+		return (store->quantum_len);
+	return (store->cache->size);
+}
+
+/*
+ * quanta taken out of a live store; lockless readers may still use them,
+ * so they are freed from scull_wq after an SRCU grace period. The store
+ * itself may be gone by then, hence the copy of its geometry
+ */
+struct scull_retire {
+	struct	rcu_head	rcu;
+	struct	work_struct	work;
+	struct	scull_cache	*cache;
+	struct	scull_spill	*spill;
+	size_t	quantum_len;
+	size_t	nr;
+	void	*quanta[];
+};
+
+struct scull_retire *scull_retire_alloc(struct scull_store *store,
+		size_t max)
+{
+	struct scull_retire *retire;
+
+	retire = kmalloc(struct_size(retire, quanta, max), GFP_KERNEL);
+	if (retire == NULL)
+		return (NULL);
+	retire->cache = store->cache;
+	retire->spill = store->spill;
+	retire->quantum_len = store->quantum_len;
+	retire->nr = 0;
+	return (retire);
+}
+
+/*
+ * the quantum, compressed, spilled or not, must already be unreachable
+ * for new readers
+ */
+void scull_retire_add(struct scull_retire *retire, struct scull_store *store,
+		void *quantum)
+{
+
+	/* a frame goes back to the region at once, see dax.c */
+	if (store->dax != NULL) {
+		scull_quantum_free(store, quantum);
+		return;
+	}
+	if (scull_slot_compressed(quantum))
+		scull_zquantum_unaccount(store, quantum);
+	else if (scull_slot_spilled(quantum))
+		scull_spill_unaccount(store, quantum);
+	else
+		scull_quantum_account(store, quantum, -1);
+	retire->quanta[retire->nr++] = quantum;
+}
+
+static void scull_retire_work(struct work_struct *work)
+{
+	struct scull_retire *retire;
+	size_t i;
+
+	retire = container_of(work, struct scull_retire, work);
+	for (i = 0; i < retire->nr; i++)
+		__scull_quantum_release(retire->cache, retire->spill,
+				retire->quantum_len, retire->quanta[i]);
+	kfree(retire);
+}
+
+static void scull_retire_rcu(struct rcu_head *rcu)
+{
+	struct scull_retire *retire;
+
+	retire = container_of(rcu, struct scull_retire, rcu);
+	INIT_WORK(&retire->work, scull_retire_work);
+	queue_work(scull_wq, &retire->work);
+}
+
+void scull_retire(struct scull_retire *retire)
+{
+
+	if (retire->nr == 0) {
+		kfree(retire);
+		return;
+	}
+	call_srcu(&scull_srcu, &retire->rcu, scull_retire_rcu);
+}
+
+/*
+ * only the class of the default geometry is created up front
+ */
+int scull_quantum_init(void)
+{
+
+	if (scull_pages)
+		return (0);
+	return (PTR_ERR_OR_ZERO(scull_quantum_cache(scull_quantum)));
+}
+
+void scull_quantum_cleanup(void)
+{
+	unsigned int class;
+
+	for (class = 0; class < SCULL_NR_CLASSES; class++) {
+		scull_cache_destroy(scull_caches[class]);
+		scull_caches[class] = NULL;
+	}
+	/* every store is gone, so are the shares */
+	WARN_ON(!xa_empty(&scull_shares));
+}
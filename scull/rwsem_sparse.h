@@ -0,0 +1,68 @@
+#ifndef __RWSEM_SPARSE_H__
+#define __RWSEM_SPARSE_H__
+
+#include <linux/rwsem.h>
+/*
+ * down_read/down_write do not use sparse; thus we provide our own
+ */
+static inline int __down_read_killable_sparse(struct rw_semaphore *sem)
+	__acquires(sem)
+{
+	int ret = down_read_killable(sem);
+	if (!ret)
+		__acquire(sem);
+
+	return (ret);
+}
+
+static inline void __down_read_sparse(struct rw_semaphore *sem)
+	__acquires(sem)
+{
+	__acquire(sem);
+	down_read(sem);
+}
+
+static inline int __down_read_trylock_sparse(struct rw_semaphore *sem)
+	__acquires(sem)
+{
+	int ret = down_read_trylock(sem);
+	if (ret)
+		__acquire(sem);
+
+	return (ret);
+}
+
+static inline void __up_read_sparse(struct rw_semaphore *sem)
+	__releases(sem)
+{
+
+	__release(sem);
+	up_read(sem);
+}
+
+static inline int __down_write_killable_sparse(struct rw_semaphore *sem)
+	__acquires(sem)
+{
+	int ret = down_write_killable(sem);
+	if (!ret)
+		__acquire(sem);
+
+	return (ret);
+}
+
+static inline void __down_write_sparse(struct rw_semaphore *sem)
+	__acquires(sem)
+{
+	__acquire(sem);
+	down_write(sem);
+}
+
+static inline void __up_write_sparse(struct rw_semaphore *sem)
+	__releases(sem)
+{
+
+	__release(sem);
+	up_write(sem);
+}
+
+#endif
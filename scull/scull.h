@@ -2,8 +2,18 @@
 #define __SCULL_H__
 
 /* IOW, IOR, etc */
+#include <linux/atomic.h>
 #include <linux/cdev.h>
+#include <linux/fs.h>
 #include <linux/ioctl.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
+#include <linux/srcu.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 
 /* dynamic major by default */
 #ifndef SCULL_MAJOR
@@ -21,9 +31,9 @@
 
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use an xarray of indirect blocks, indexed by qset number.
  *
- * "scull_dev->qset" points to an array of pointers, each
+ * "scull_qset->data" points to an array of pointers, each
  * pointer refers to a memory area of SCULL_QUANTUM bytes.
  *
  * The array (quantum-set) is SCULL_QSET long.
@@ -36,6 +46,26 @@
 #define SCULL_QSET		1000
 #endif
 
+/* quanta cached per cpu for the write path */
+#ifndef SCULL_MAGAZINE
+#define SCULL_MAGAZINE		16
+#endif
+
+/* writes covering that many quanta allocate them in bulk */
+#ifndef SCULL_BULK
+#define SCULL_BULK		8
+#endif
+
+/* capacity of the block devices */
+#ifndef SCULL_BLK_SIZE
+#define SCULL_BLK_SIZE		(256UL << 20)
+#endif
+
+/* entries of one SCULL_IOCBATCH */
+#ifndef SCULL_BATCH_MAX
+#define SCULL_BATCH_MAX		4096
+#endif
+
 /* circular buffer */
 #ifndef SCULL_P_LEN
 #define SCULL_P_LEN		4000
@@ -45,17 +75,105 @@
  * representation of scull quantum sets
  */
 struct scull_qset {
-	void 	**data;
-	struct	scull_qset	*next;
+	void 	__rcu	**data;		/* qset_len quantum pointers */
+	struct	mutex	lock;		/* serializes writers of this qset */
+	unsigned long	atime;		/* last access, see compress.c */
+	unsigned long	idx;		/* qset number */
 };
 
-struct scull_dev {
-	struct	scull_qset	*qset; 	/* point to first quantum set */
+/*
+ * a slot may hold a compressed quantum instead, tagged in its low bit, or
+ * the offset of a quantum spilled to the backing file, tagged in the next
+ * one; __scull_quantum_load() gives back the quantum itself
+ */
+#define SCULL_ZTAG		1UL
+#define SCULL_STAG		2UL
+
+static inline bool scull_slot_compressed(const void *quantum)
+{
+
+	return ((unsigned long)quantum & SCULL_ZTAG);
+}
+
+static inline bool scull_slot_spilled(const void *quantum)
+{
+
+	return ((unsigned long)quantum & SCULL_STAG);
+}
+
+/* anything but a quantum or a hole */
+static inline bool scull_slot_tagged(const void *quantum)
+{
+
+	return ((unsigned long)quantum & (SCULL_ZTAG | SCULL_STAG));
+}
+
+/*
+ * memory accounting of a store, kept current on allocation and free so
+ * that nobody has to walk the qsets for it (see /proc/scullstat)
+ */
+struct scull_stats {
+	atomic_long_t	quanta;		/* quanta allocated */
+	atomic_long_t	qsets;		/* qsets (and pointer arrays) */
+	atomic_long_t	zquanta;	/* compressed quanta */
+	atomic_long_t	zbytes;		/* and their compressed size */
+	atomic_long_t	spilled;	/* quanta in the backing file */
+	atomic_long_t	*nodes;		/* quanta by node, nr_node_ids */
+};
+
+struct scull_cache;
+struct scull_dax;
+struct scull_dedup;
+struct scull_spill;
+
+/*
+ * a range reserved by an O_APPEND writer, see __scull_append()
+ */
+struct scull_append {
+	struct	list_head	list;
+	size_t	start;
+};
+
+/*
+ * the quantum sets of a device and the geometry they were built with;
+ * readers reach it under scull_srcu, a trim replaces it as a whole
+ */
+struct scull_store {
+	struct	xarray		qsets; 	/* quantum sets, by qset number */
 	size_t	quantum_len;		/* the current quantum size */
 	size_t	qset_len;		/* the current array size */
 	size_t	len;			/* amount of data stored here */
+	size_t	tail;			/* end of the appends in flight */
+	struct	list_head	appends;	/* in flight, by offset */
+	size_t	pending;		/* length once they are written */
+	bool	pages;			/* page backed quanta, mmap-able */
+	bool	compact;		/* one slot per qset until it grows */
+	struct	scull_cache	*cache;	/* of slab quanta, by size class */
+	bool	shared;			/* may share quanta with a snapshot */
+	struct	scull_dedup	*dedup;	/* recently written quanta, or NULL */
+	u32	policy;			/* placement of new quanta */
+	int	node;			/* bound node */
+	int	rotor;			/* last interleaved node */
+	struct	scull_spill	*spill;	/* memory limit, or NULL */
+	struct	scull_dax	*dax;	/* pmem region, or NULL */
+	struct	scull_dev	*moved;	/* repacked into its store, or NULL */
+	struct	scull_stats	stats;
+	struct	rcu_head	rcu;	/* deferred free after a trim */
+	struct	work_struct	free_work;
+};
+
+struct scull_dev {
+	struct	scull_store	__rcu *store;
 	u32	access_key;		/* used by sculluid and scullpriv */
-	struct	mutex	lock;
+	atomic_t	maps;		/* vmas, -1 while snapshotted */
+	size_t	quantum;		/* own geometry, 0 for the defaults */
+	size_t	qset;
+	u32	policy;			/* placement, see SCULL_IOCSPLACEMENT */
+	int	node;
+	struct	scull_spill	*spill;	/* see SCULL_IOCSLIMIT */
+	struct	scull_dax	*dax;	/* see scull_dax */
+	/* shared by writers, exclusive for trim */
+	struct	rw_semaphore	lock;
 	struct	cdev		cdev;
 };
 
@@ -73,9 +191,64 @@ struct scull_follow {
 
 extern int 	scull_major;
 extern size_t 	scull_nr_devs;
+extern size_t	scull_nr_blk;
+extern size_t	scull_blk_size;
 extern size_t 	scull_quantum;
 extern size_t	scull_qset;
+extern bool	scull_pages;
 extern struct scull_dev *scull_devices;
+extern struct srcu_struct scull_srcu;
+extern struct workqueue_struct *scull_wq;
+extern bool	scull_compressing;
+
+/*
+ * quanta from a slab cache: those alone are compressed, spilled and
+ * deduplicated
+ */
+static inline bool scull_store_slab(const struct scull_store *store)
+{
+
+	return (store->cache != NULL);
+}
+
+static inline struct scull_store *scull_store_locked(struct scull_dev *dev)
+{
+
+	return (rcu_dereference_protected(dev->store,
+				lockdep_is_held(&dev->lock)));
+}
+
+/*
+ * a process could write through a mapping without any fault; page backed
+ * stores are only rebuilt, trimmed or punched while unmapped, and mmap()
+ * waits for the end
+ */
+static inline bool __scull_maps_block(struct scull_dev *dev,
+		struct scull_store *store)
+{
+
+	return (!store->pages || atomic_cmpxchg(&dev->maps, 0, -1) == 0);
+}
+
+static inline void __scull_maps_unblock(struct scull_dev *dev,
+		struct scull_store *store)
+{
+
+	if (store->pages)
+		atomic_set(&dev->maps, 0);
+}
+
+/*
+ * cold qsets get compressed; the time is kept to the second so that
+ * readers do not keep writing to a shared line
+ */
+static inline void scull_qset_touch(struct scull_qset *qset)
+{
+
+	if (scull_compressing && time_after(jiffies,
+	    READ_ONCE(qset->atime) + HZ))
+		WRITE_ONCE(qset->atime, jiffies);
+}
 
 
 /* ioctl */
@@ -111,18 +284,265 @@ extern struct scull_dev *scull_devices;
  */
 #define SCULL_P_IOCTSIZE 	_IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE 	_IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * fallocate(2) never reaches a character device (vfs_fallocate() fails
+ * with ENODEV), hence an ioctl taking the same arguments. Supported
+ * modes: 0, FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE
+ */
+struct scull_falloc {
+	__u32	mode;
+	__u32	pad;
+	__u64	offset;
+	__u64	len;
+};
+
+#define SCULL_IOCFALLOCATE	_IOW(SCULL_IOC_MAGIC, 15, struct scull_falloc)
+
+/*
+ * issued on the target opened for writing, the argument is a descriptor
+ * of the device to snapshot (like FICLONE)
+ */
+#define SCULL_IOCTSNAPSHOT	_IO(SCULL_IOC_MAGIC,  16)
+
+/*
+ * geometry of one device, set on an empty device only; 0 stands for the
+ * module defaults, which SCULL_IOCSQUANTUM and friends change. Get
+ * reports the geometry in use
+ */
+struct scull_geometry {
+	__u64	quantum;
+	__u64	qset;
+};
+
+#define SCULL_IOCSGEOMETRY	_IOW(SCULL_IOC_MAGIC, 17, struct scull_geometry)
+#define SCULL_IOCGGEOMETRY	_IOR(SCULL_IOC_MAGIC, 18, struct scull_geometry)
+
+/*
+ * like SCULL_IOCSGEOMETRY on a device holding data: its contents are
+ * moved to the new geometry, dropping empty qsets and what lies past the
+ * end of the device. The device lock is held exclusively for the whole
+ * copy, writers block until it is done
+ */
+#define SCULL_IOCREPACK		_IOW(SCULL_IOC_MAGIC, 19, struct scull_geometry)
+
+/*
+ * NUMA node new quanta of a device are allocated on: the one of the
+ * writer (the default), every online node in turn, or a given node as
+ * long as it has memory. Quanta already allocated stay where they are,
+ * /proc/scullnodes tells where they are
+ */
+#define SCULL_PLACE_LOCAL	0
+#define SCULL_PLACE_INTERLEAVE	1
+#define SCULL_PLACE_BIND	2
+
+struct scull_placement {
+	__u32	policy;
+	__s32	node;		/* SCULL_PLACE_BIND only */
+};
+
+#define SCULL_IOCSPLACEMENT	_IOW(SCULL_IOC_MAGIC, 20, struct scull_placement)
+#define SCULL_IOCGPLACEMENT	_IOR(SCULL_IOC_MAGIC, 21, struct scull_placement)
+
+/*
+ * memory limit of a device: above limit bytes of quanta, the coldest
+ * ones are written to the first size bytes of the file fd, opened for
+ * reading and writing, and read back on their next access. A limit of 0
+ * lifts the cap. fd -1 keeps the current file, which can only be
+ * replaced while nothing is spilled to it. The file can't be opened
+ * with O_APPEND, nor be the backing file of another device.
+ *
+ * Quanta are spilled in the background, a device may go over its limit
+ * until the worker catches up. Once the file is full, writes to a device
+ * over its limit fail with ENOSPC
+ */
+struct scull_limit {
+	__u64	limit;
+	__u64	size;
+	__s32	fd;
+	__u32	pad;
+};
+
+#define SCULL_IOCSLIMIT		_IOW(SCULL_IOC_MAGIC, 22, struct scull_limit)
+
+/*
+ * up to SCULL_BATCH_MAX reads and writes in one call, under one lock
+ * acquisition. They are carried out by offset, or in array order when a
+ * write overlaps another entry; result gets the bytes transferred or
+ * -errno. An interrupted batch leaves -EINTR in the entries it did not
+ * reach
+ */
+#define SCULL_BATCH_READ	0
+#define SCULL_BATCH_WRITE	1
+
+struct scull_batch_ent {
+	__u64	offset;
+	__u64	buf;		/* user address */
+	__u32	len;
+	__u32	op;
+	__s64	result;
+};
+
+struct scull_batch {
+	__u64	ents;		/* user address of nr scull_batch_ent */
+	__u32	nr;
+	__u32	pad;
+};
+
+#define SCULL_IOCBATCH		_IOW(SCULL_IOC_MAGIC, 23, struct scull_batch)
+
+/*
+ * the contents of all devices, holes left out, into the regular file
+ * passed as the argument descriptor, opened for writing but not
+ * O_APPEND, which is truncated to the end of the image; loading the module with
+ * scull_restore=<path> brings them back. CAP_SYS_ADMIN only
+ */
+#define SCULL_IOCTCHECKPOINT	_IO(SCULL_IOC_MAGIC,  24)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 	14
+#define SCULL_IOC_MAXNR 	24
 void scull_cleanup_module(void);
 int scull_init_module(void);
 int scull_open(struct inode *inode, struct file *filp);
 int scull_release(struct inode *inode, struct file *filp);
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count, 
-		loff_t *f_pos);
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-		loff_t *f_pos);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 void scull_create_proc(void);
 void scull_remove_proc(void);
 
+struct scull_dev *scull_dev_of(struct file *filp);
+struct scull_store *scull_store_alloc(const struct scull_dev *dev);
+int __scull_store_layout(struct scull_store *store, size_t quantum,
+		size_t qset);
+int scull_set_geometry(struct scull_dev *dev, size_t quantum, size_t qset);
+int scull_set_placement(struct scull_dev *dev, u32 policy, int node);
+void scull_store_free(struct scull_store *store);
+void __scull_store_replace(struct scull_dev *dev, struct scull_store *store);
+struct scull_qset *__scull_follow(struct scull_store *store,
+		struct scull_follow *flw, const loff_t *f_pos);
+size_t __scull_qset_left(const struct scull_store *store,
+		const struct scull_follow *flw);
+void __scull_follow_next(struct scull_follow *flw);
+struct scull_qset *__scull_qset_alloc(struct scull_store *store,
+		unsigned long idx);
+void __scull_qsets_reserve(struct scull_store *store, unsigned long first,
+		unsigned long last);
+void __scull_qset_fill(struct scull_store *store, struct scull_qset *qset,
+		size_t first, size_t nr, void **quanta);
+void *__scull_quantum_install(struct scull_store *store, void __rcu **slot,
+		void *quantum);
+void *__scull_quantum_load(struct scull_store *store, void __rcu **slot);
+void *__scull_quantum_clone(struct scull_store *store,
+		struct scull_store *to, void *tagged);
+void *__scull_quantum_unshare(struct scull_store *store, void __rcu **slot);
+void __scull_store_extend(struct scull_store *store, size_t end);
+struct scull_store *__scull_store_grow(struct scull_dev *dev,
+		struct scull_store *store, loff_t end);
+ssize_t __scull_read(struct scull_store *store, struct iov_iter *to,
+		loff_t *f_pos, bool nowait);
+ssize_t __scull_write(struct scull_dev *dev, struct scull_store *store,
+		struct iov_iter *from, loff_t *f_pos, bool nowait);
+
+/* quantum.c */
+struct scull_retire;
+
+int scull_quantum_init(void);
+void scull_quantum_cleanup(void);
+struct scull_cache *scull_quantum_cache(size_t size);
+void *scull_quantum_alloc(struct scull_store *store, gfp_t gfp);
+void *scull_quantum_alloc_at(struct scull_store *store,
+		struct scull_qset *qset, size_t i);
+size_t scull_quantum_alloc_bulk(struct scull_store *store, gfp_t gfp,
+		size_t nr, void **quanta);
+void scull_quantum_free(struct scull_store *store, void *quantum);
+void scull_quantum_account(struct scull_store *store, void *quantum,
+		long delta);
+void scull_quantum_free_bulk(struct scull_store *store, size_t nr,
+		void **quanta);
+size_t scull_quantum_footprint(const struct scull_store *store);
+int scull_quantum_share(void *quantum);
+bool scull_quantum_shared(void *quantum);
+struct scull_retire *scull_retire_alloc(struct scull_store *store,
+		size_t max);
+void scull_retire_add(struct scull_retire *retire, struct scull_store *store,
+		void *quantum);
+void scull_retire(struct scull_retire *retire);
+
+/* hole.c */
+loff_t scull_llseek(struct file *filp, loff_t off, int whence);
+long scull_fallocate(struct scull_dev *dev, int mode, loff_t offset,
+		loff_t len);
+
+/* snap.c */
+long scull_snapshot(struct scull_dev *dev, struct scull_dev *to);
+long scull_repack(struct scull_dev *dev, size_t quantum, size_t qset);
+long scull_grow(struct scull_dev *dev);
+struct scull_store *scull_snapshot_take(struct scull_dev *dev,
+		const struct scull_dev *to);
+void scull_snapshot_drop(struct scull_dev *dev, struct scull_store *snap);
+void scull_store_unshared(struct scull_dev *dev);
+
+/* compress.c */
+int scull_compress_init(void);
+void scull_compress_cleanup(void);
+int scull_zquantum_read(struct scull_store *store, void *zquantum,
+		void *quantum);
+void *scull_quantum_inflate(struct scull_store *store, void __rcu **slot,
+		void *zquantum);
+void scull_zquantum_unaccount(struct scull_store *store, void *zquantum);
+void scull_zquantum_free(void *zquantum);
+
+/* spill.c */
+int scull_set_limit(struct scull_dev *dev, size_t limit, struct file *file,
+		size_t size);
+void scull_spill_check(struct scull_store *store);
+bool scull_spill_full(struct scull_store *store);
+int scull_spill_read(struct scull_store *store, void *marker, void *quantum);
+void *scull_quantum_unspill(struct scull_store *store, void __rcu **slot,
+		void *marker);
+void scull_spill_unaccount(struct scull_store *store, void *marker);
+void scull_spill_free(struct scull_spill *spill, size_t quantum_len,
+		void *marker);
+void scull_spill_cancel(struct scull_dev *dev);
+void scull_spill_destroy(struct scull_dev *dev);
+
+/* batch.c */
+long scull_batch(struct scull_dev *dev, struct file *filp,
+		struct scull_batch_ent __user *uents, size_t nr);
+
+/* ckpt.c */
+long scull_checkpoint(struct file *file);
+void scull_ckpt_restore(void);
+
+/* dax.c */
+void scull_dax_init(void);
+void scull_dax_cleanup(void);
+loff_t scull_dax_size(const struct scull_dax *dax);
+int scull_dax_layout(struct scull_dax *dax, struct scull_store *store,
+		size_t qset);
+void *scull_dax_claim(struct scull_dax *dax, unsigned long n);
+void scull_dax_unclaim(struct scull_dax *dax, void *frame);
+size_t scull_dax_copy(void *addr, size_t size, struct iov_iter *from);
+void scull_dax_zero(void *addr, size_t size);
+void scull_dax_flush(struct scull_dax *dax);
+void scull_dax_set_len(struct scull_dax *dax, size_t len);
+void scull_dax_clear(struct scull_dax *dax);
+
+/* blk.c */
+int scull_blk_init(void);
+void scull_blk_cleanup(void);
+
+/* mmap.c */
+int scull_mmap(struct file *filp, struct vm_area_struct *vma);
+
+/* splice.c */
+ssize_t scull_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+
+/* dedup.c */
+void scull_dedup_free(struct scull_store *store);
+ssize_t __scull_quantum_write_whole(struct scull_store *store,
+		struct scull_qset *qset, const struct scull_follow *flw,
+		struct iov_iter *from, struct scull_retire **retire);
+
 #endif
@@ -0,0 +1,344 @@
+#include <linux/slab.h>
+
+#include "rwsem_sparse.h"
+#include "scull.h"
+
+/*
+ * a store with the geometry of store, sharing all of its quanta but the
+ * compressed and spilled ones, of which it gets a copy: the slots of
+ * store are left alone, not to undo the compression or go over the
+ * memory limit. Called with scull_srcu read-held, readers may retire
+ * what a tagged slot points to
+ */
+static int __scull_snap_fill(struct scull_store *snap,
+		struct scull_store *store, struct scull_dev *dev)
+	__must_hold(&dev->lock)
+{
+	struct	scull_qset	*qset, *copy;
+	unsigned long	idx;
+	void	*quantum;
+	size_t	i;
+
+	lockdep_assert_held_write(&dev->lock);
+
+	snap->quantum_len = store->quantum_len;
+	snap->qset_len = store->qset_len;
+	snap->pages = store->pages;
+	snap->compact = store->compact;
+	snap->cache = store->cache;
+	snap->shared = true;
+	WRITE_ONCE(store->shared, true);
+
+	xa_for_each(&store->qsets, idx, qset) {
+		copy = __scull_qset_alloc(snap, idx);
+		if (copy == NULL)
+			return (-ENOMEM);
+		for (i = 0; i < store->qset_len; i++) {
+			/* page faults may still fill holes, never more */
+			quantum = READ_ONCE(*(void __force **)&qset->data[i]);
+			if (quantum == NULL)
+				continue;
+			if (scull_slot_tagged(quantum)) {
+				quantum = __scull_quantum_clone(store, snap,
+						quantum);
+				if (IS_ERR(quantum))
+					return (PTR_ERR(quantum));
+				RCU_INIT_POINTER(copy->data[i], quantum);
+				continue;
+			}
+			if (scull_quantum_share(quantum))
+				return (-ENOMEM);
+			RCU_INIT_POINTER(copy->data[i], quantum);
+			scull_quantum_account(snap, quantum, 1);
+		}
+	}
+	snap->len = store->len;
+	return (0);
+}
+
+/*
+ * a store of to, not published, sharing all of the quanta of dev at this
+ * point in time; an ERR_PTR on failure. Writers of dev only wait for the
+ * quantum pointers to be walked
+ */
+struct scull_store *scull_snapshot_take(struct scull_dev *dev,
+		const struct scull_dev *to)
+{
+	struct	scull_store	*store, *snap;
+	int	idx, ret;
+
+	/* quanta in persistent memory are not shared, see dax.c */
+	if (dev->dax != NULL || to->dax != NULL)
+		return (ERR_PTR(-EOPNOTSUPP));
+	snap = scull_store_alloc(to);
+	if (snap == NULL)
+		return (ERR_PTR(-ENOMEM));
+
+	if (__down_write_killable_sparse(&dev->lock)) {
+		scull_store_free(snap);
+		return (ERR_PTR(-ERESTARTSYS));
+	}
+	store = scull_store_locked(dev);
+	if (!__scull_maps_block(dev, store)) {
+		ret = -EBUSY;
+	} else {
+		idx = srcu_read_lock(&scull_srcu);
+		ret = __scull_snap_fill(snap, store, dev);
+		srcu_read_unlock(&scull_srcu, idx);
+		__scull_maps_unblock(dev, store);
+	}
+	__up_write_sparse(&dev->lock);
+	if (ret) {
+		/* drops the shares taken so far */
+		scull_store_free(snap);
+		return (ERR_PTR(ret));
+	}
+	return (snap);
+}
+
+/*
+ * once none of the quanta of dev is shared anymore, its writers stop
+ * looking for shares; called after a store that shared them is freed
+ */
+void scull_store_unshared(struct scull_dev *dev)
+{
+	struct	scull_store	*store;
+	struct	scull_qset	*qset;
+	unsigned long	idx;
+	void	*quantum;
+	size_t	i;
+
+	__down_write_sparse(&dev->lock);
+	store = scull_store_locked(dev);
+	if (!store->shared)
+		goto out;
+	/* nothing new is shared without the lock, see __scull_snap_fill() */
+	xa_for_each(&store->qsets, idx, qset) {
+		for (i = 0; i < store->qset_len; i++) {
+			quantum = rcu_dereference_protected(qset->data[i],
+					lockdep_is_held(&dev->lock));
+			if (quantum != NULL && !scull_slot_tagged(quantum) &&
+			    scull_quantum_shared(quantum))
+				goto out;
+		}
+		cond_resched();
+	}
+	WRITE_ONCE(store->shared, false);
+out:
+	__up_write_sparse(&dev->lock);
+}
+
+/*
+ * free a snapshot of dev that was never published
+ */
+void scull_snapshot_drop(struct scull_dev *dev, struct scull_store *snap)
+{
+
+	scull_store_free(snap);
+	scull_store_unshared(dev);
+}
+
+/*
+ * point in time copy of dev into to, replacing its contents like a trim.
+ * The two devices share the quanta and whichever writes to one first gets
+ * a copy of its own, see __scull_quantum_unshare().
+ *
+ * Page backed devices are not snapshotted while mapped, later write
+ * faults unshare.
+ */
+long scull_snapshot(struct scull_dev *dev, struct scull_dev *to)
+{
+	struct scull_store *snap;
+
+	snap = scull_snapshot_take(dev, to);
+	if (IS_ERR(snap))
+		return (PTR_ERR(snap));
+
+	if (__down_write_killable_sparse(&to->lock)) {
+		scull_store_free(snap);
+		return (-ERESTARTSYS);
+	}
+	__scull_store_replace(to, snap);
+	__up_write_sparse(&to->lock);
+	return (0);
+}
+
+/*
+ * the n bytes at quantum, found at off, into the quanta of new
+ */
+static int __scull_repack_copy(struct scull_store *new, void *quantum,
+		loff_t off, size_t n)
+{
+	struct	scull_qset	*qset;
+	struct	scull_follow	 flw;
+	size_t	chunk;
+	void	*dst;
+
+	while (n != 0) {
+		qset = __scull_follow(new, &flw, &off);
+		if (qset == NULL)
+			qset = __scull_qset_alloc(new, flw.qset_p);
+		if (qset == NULL)
+			return (-ENOMEM);
+		/* new is not published yet */
+		dst = rcu_dereference_protected(qset->data[flw.quantum_p], 1);
+		if (dst == NULL) {
+			dst = scull_quantum_alloc(new, GFP_KERNEL);
+			if (dst == NULL)
+				return (-ENOMEM);
+			RCU_INIT_POINTER(qset->data[flw.quantum_p], dst);
+		}
+		chunk = min(n, new->quantum_len - flw.offset_p);
+		memcpy(dst + flw.offset_p, quantum, chunk);
+		quantum += chunk;
+		off += chunk;
+		n -= chunk;
+	}
+	return (0);
+}
+
+/*
+ * with an unchanged quantum size the quanta are not copied but shared
+ * with the old store until it is freed
+ */
+static int __scull_repack_move(struct scull_store *new, void *quantum,
+		loff_t off)
+{
+	struct	scull_qset	*qset;
+	struct	scull_follow	 flw;
+
+	qset = __scull_follow(new, &flw, &off);
+	if (qset == NULL)
+		qset = __scull_qset_alloc(new, flw.qset_p);
+	if (qset == NULL || scull_quantum_share(quantum))
+		return (-ENOMEM);
+	RCU_INIT_POINTER(qset->data[flw.quantum_p], quantum);
+	scull_quantum_account(new, quantum, 1);
+	return (0);
+}
+
+static int __scull_repack_fill(struct scull_store *new,
+		struct scull_store *store, struct scull_dev *dev)
+	__must_hold(&dev->lock)
+{
+	/*
+	 * page faults fill a compact store without growing it, so it may
+	 * hold a lot: its quanta move as well
+	 */
+	const	bool	move = new->quantum_len == store->quantum_len;
+	struct	scull_qset	*qset;
+	unsigned long	idx;
+	void	*quantum;
+	loff_t	off;
+	size_t	i;
+	int	ret;
+
+	lockdep_assert_held_write(&dev->lock);
+
+	if (move) {
+		new->shared = true;
+		WRITE_ONCE(store->shared, true);
+	}
+	xa_for_each(&store->qsets, idx, qset) {
+		for (i = 0; i < store->qset_len; i++) {
+			quantum = __scull_quantum_load(store, &qset->data[i]);
+			if (IS_ERR(quantum))
+				return (PTR_ERR(quantum));
+			off = ((loff_t)idx * store->qset_len + i) *
+				store->quantum_len;
+			/* holes and preallocated space past the end go */
+			if (quantum == NULL || off >= (loff_t)store->len)
+				continue;
+			if (move)
+				ret = __scull_repack_move(new, quantum, off);
+			else
+				ret = __scull_repack_copy(new, quantum, off,
+						min_t(size_t, store->quantum_len,
+						store->len - off));
+			if (ret)
+				return (ret);
+		}
+	}
+	new->len = store->len;
+	return (0);
+}
+
+/*
+ * rebuild dev with a new geometry, like SCULL_IOCSGEOMETRY would on an
+ * empty device. Only quanta holding data are carried over, empty qsets
+ * disappear.
+ *
+ * Readers go on with the old store until the new one is published;
+ * the lock is held for writing during the whole copy, so writers wait
+ * for the rebuild, however large the device. With grow, only a compact
+ * store is rebuilt, anything else is left as it is.
+ *
+ * Quanta of the same size move by reference: the new store shares them
+ * until the old one is freed, then its writers stop looking for shares,
+ * see scull_store_free_work()
+ */
+static long __scull_repack(struct scull_dev *dev, size_t quantum,
+		size_t qset, bool grow)
+{
+	struct	scull_store	*store, *new;
+	int	ret;
+
+	new = scull_store_alloc(dev);
+	if (new == NULL)
+		return (-ENOMEM);
+	ret = __scull_store_layout(new, quantum ? quantum : scull_quantum,
+			qset ? qset : scull_qset);
+	if (ret)
+		goto fail;
+
+	if (__down_write_killable_sparse(&dev->lock)) {
+		ret = -ERESTARTSYS;
+		goto fail;
+	}
+	store = scull_store_locked(dev);
+	if (grow && !store->compact) {
+		/* another writer was first */
+		ret = 0;
+		__up_write_sparse(&dev->lock);
+		goto fail;
+	}
+	if (!__scull_maps_block(dev, store)) {
+		ret = -EBUSY;
+	} else {
+		ret = __scull_repack_fill(new, store, dev);
+		if (ret == 0) {
+			/* the moved quanta are its own once store is gone */
+			if (new->shared)
+				store->moved = dev;
+			__scull_store_replace(dev, new);
+			dev->quantum = quantum;
+			dev->qset = qset;
+		}
+		__scull_maps_unblock(dev, store);
+	}
+	__up_write_sparse(&dev->lock);
+	if (ret == 0)
+		return (0);
+fail:
+	scull_store_free(new);
+	return (ret);
+}
+
+long scull_repack(struct scull_dev *dev, size_t quantum, size_t qset)
+{
+
+	/* the region fixes the quantum, and where each one is */
+	if (dev->dax != NULL)
+		return (-EINVAL);
+	return (__scull_repack(dev, quantum, qset, false));
+}
+
+/*
+ * the full geometry for a compact store, see __scull_store_geometry()
+ */
+long scull_grow(struct scull_dev *dev)
+{
+
+	return (__scull_repack(dev, READ_ONCE(dev->quantum),
+			READ_ONCE(dev->qset), true));
+}
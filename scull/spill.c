@@ -0,0 +1,381 @@
+#include <linux/fs.h>
+#include <linux/genalloc.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "mutex_sparse.h"
+#include "rwsem_sparse.h"
+#include "scull.h"
+
+/*
+ * a device over its memory limit has the quanta of its coldest qsets
+ * written to a backing file, their slots then hold the file offset
+ * (tagged with SCULL_STAG) until the next access reads them back. Like
+ * compression, only slab backed devices spill, and never shared quanta.
+ *
+ * Space in the file is handed out by a gen_pool; it is given back, like
+ * memory, once no reader can still be reading it.
+ */
+
+/* allocation unit in the file, the marker tags live below it */
+#define SCULL_SPILL_ORDER	9
+#define SCULL_SPILL_BASE	(1UL << SCULL_SPILL_ORDER)
+
+/* qsets idle that long go first, then younger ones */
+#define SCULL_SPILL_AGE		(64 * HZ)
+
+struct scull_spill {
+	struct	mutex		lock;	/* of the fields below, and the scan */
+	struct	scull_dev	*dev;
+	struct	file		*file;
+	struct	gen_pool	*pool;	/* free space of file, from BASE */
+	size_t	limit;			/* bytes of quanta, 0 for none */
+	bool	full;			/* no room left in file */
+	struct	work_struct	work;
+};
+
+static loff_t scull_spill_pos(void *marker)
+{
+
+	return ((unsigned long)marker & ~SCULL_STAG);
+}
+
+static bool scull_spill_over(struct scull_store *store,
+		struct scull_spill *spill)
+{
+	const	size_t	limit = READ_ONCE(spill->limit);
+
+	return (limit != 0 &&
+	    atomic_long_read(&store->stats.quanta) *
+	    scull_quantum_footprint(store) +
+	    atomic_long_read(&store->stats.zbytes) > limit);
+}
+
+void scull_spill_check(struct scull_store *store)
+{
+	struct scull_spill *spill = READ_ONCE(store->spill);
+
+	if (spill != NULL && scull_store_slab(store) &&
+	    scull_spill_over(store, spill))
+		queue_work(scull_wq, &spill->work);
+}
+
+/*
+ * over the limit with nothing more to spill to: writers get -ENOSPC
+ * instead of growing the device further
+ */
+bool scull_spill_full(struct scull_store *store)
+{
+	struct scull_spill *spill = READ_ONCE(store->spill);
+
+	return (spill != NULL && scull_store_slab(store) &&
+	    READ_ONCE(spill->full) && scull_spill_over(store, spill));
+}
+
+void scull_spill_unaccount(struct scull_store *store, void *marker)
+{
+
+	atomic_long_dec(&store->stats.spilled);
+}
+
+void scull_spill_free(struct scull_spill *spill, size_t quantum_len,
+		void *marker)
+{
+
+	gen_pool_free(spill->pool, scull_spill_pos(marker) + SCULL_SPILL_BASE,
+			quantum_len);
+	if (READ_ONCE(spill->full))
+		WRITE_ONCE(spill->full, false);
+}
+
+/*
+ * the contents of a spilled quantum of store, into quantum
+ */
+int scull_spill_read(struct scull_store *store, void *marker, void *quantum)
+{
+	loff_t	pos = scull_spill_pos(marker);
+	ssize_t	n;
+
+	n = kernel_read(store->spill->file, quantum, store->quantum_len, &pos);
+	if (n != (ssize_t)store->quantum_len)
+		return (n < 0 ? n : -EIO);
+	return (0);
+}
+
+/*
+ * read a spilled quantum back and put it in its slot, readers racing for
+ * it share the winner's; the file space is retired as other readers may
+ * still be reading it.
+ *
+ * returns what the slot holds now, an ERR_PTR on failure
+ */
+void *scull_quantum_unspill(struct scull_store *store, void __rcu **slot,
+		void *marker)
+{
+	struct	scull_retire	*retire;
+	void	*quantum, *old;
+	int	ret;
+
+	quantum = scull_quantum_alloc(store, GFP_KERNEL);
+	retire = scull_retire_alloc(store, 1);
+	if (quantum == NULL || retire == NULL) {
+		scull_quantum_free(store, quantum);
+		kfree(retire);
+		return (ERR_PTR(-ENOMEM));
+	}
+
+	ret = scull_spill_read(store, marker, quantum);
+	if (ret) {
+		scull_quantum_free(store, quantum);
+		kfree(retire);
+		return (ERR_PTR(ret));
+	}
+
+	old = cmpxchg((void __force **)slot, marker, quantum);
+	if (old == marker) {
+		scull_retire_add(retire, store, marker);
+		old = quantum;
+	} else {
+		scull_quantum_free(store, quantum);
+	}
+	scull_retire(retire);
+	scull_spill_check(store);
+	return (old);
+}
+
+/*
+ * write out the quanta of qset while store is over the limit; fails
+ * once the file is full
+ */
+static int scull_spill_qset(struct scull_store *store,
+		struct scull_spill *spill, struct scull_qset *qset)
+	__must_hold(&spill->lock)
+{
+	struct	scull_retire	*retire;
+	unsigned long	addr;
+	void	*quantum;
+	loff_t	pos;
+	size_t	i;
+	int	ret = 0;
+
+	retire = scull_retire_alloc(store, store->qset_len);
+	if (retire == NULL)
+		return (-ENOMEM);
+
+	__mutex_lock_sparse(&qset->lock);
+	for (i = 0; i < store->qset_len && scull_spill_over(store, spill);
+	    i++) {
+		quantum = rcu_dereference_protected(qset->data[i],
+				lockdep_is_held(&qset->lock));
+		if (quantum == NULL || scull_slot_tagged(quantum) ||
+		    scull_quantum_shared(quantum))
+			continue;
+		addr = gen_pool_alloc(spill->pool, store->quantum_len);
+		if (addr == 0) {
+			WRITE_ONCE(spill->full, true);
+			ret = -ENOSPC;
+			break;
+		}
+		pos = addr - SCULL_SPILL_BASE;
+		if (kernel_write(spill->file, quantum, store->quantum_len,
+		    &pos) != (ssize_t)store->quantum_len) {
+			gen_pool_free(spill->pool, addr, store->quantum_len);
+			ret = -EIO;
+			break;
+		}
+		/* writers are locked out, readers only replace tagged slots */
+		rcu_assign_pointer(qset->data[i],
+				(void *)((addr - SCULL_SPILL_BASE) | SCULL_STAG));
+		atomic_long_inc(&store->stats.spilled);
+		scull_retire_add(retire, store, quantum);
+	}
+	__mutex_unlock_sparse(&qset->lock);
+	scull_retire(retire);
+	return (ret);
+}
+
+/*
+ * qsets idle for SCULL_SPILL_AGE first, then for half of it and so on
+ * until the store is back under the limit
+ */
+static void scull_spill_store(struct scull_store *store,
+		struct scull_spill *spill)
+	__must_hold(&spill->lock)
+{
+	struct	scull_qset	*qset;
+	unsigned long	age, idx;
+
+	for (age = SCULL_SPILL_AGE; scull_spill_over(store, spill); age /= 2) {
+		xa_for_each(&store->qsets, idx, qset) {
+			if (!scull_spill_over(store, spill))
+				return;
+			if (age != 0 &&
+			    !time_before(READ_ONCE(qset->atime), jiffies - age))
+				continue;
+			if (scull_spill_qset(store, spill, qset))
+				return;
+			cond_resched();
+		}
+		if (age == 0)
+			break;
+	}
+}
+
+/*
+ * writers hold dev->lock for reading, so do we, see scull_zscan_dev()
+ */
+static void scull_spill_work(struct work_struct *work)
+{
+	struct	scull_spill	*spill;
+	struct	scull_store	*store;
+	struct	scull_dev	*dev;
+
+	spill = container_of(work, struct scull_spill, work);
+	dev = spill->dev;
+	if (__down_read_killable_sparse(&dev->lock))
+		return;
+	store = scull_store_locked(dev);
+	mutex_lock(&spill->lock);
+	if (spill->file != NULL && scull_store_slab(store))
+		scull_spill_store(store, spill);
+	mutex_unlock(&spill->lock);
+	__up_read_sparse(&dev->lock);
+}
+
+static struct scull_spill *scull_spill_alloc(struct scull_dev *dev)
+{
+	struct scull_spill *spill;
+
+	spill = kzalloc(sizeof(*spill), GFP_KERNEL);
+	if (spill == NULL)
+		return (NULL);
+	mutex_init(&spill->lock);
+	INIT_WORK(&spill->work, scull_spill_work);
+	spill->dev = dev;
+	return (spill);
+}
+
+/* the backing files of all devices change under it */
+static DEFINE_MUTEX(scull_spill_files);
+
+/*
+ * whether another device spills to the same file: each has its own pool
+ * of offsets, they would overwrite each other
+ */
+static bool scull_spill_used(struct scull_spill *spill, struct file *file)
+	__must_hold(&scull_spill_files)
+{
+	struct	scull_spill	*other;
+	size_t	i;
+
+	for (i = 0; i < scull_nr_devs; i++) {
+		other = READ_ONCE(scull_devices[i].spill);
+		if (other != NULL && other != spill && other->file != NULL &&
+		    file_inode(other->file) == file_inode(file))
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * a file nothing is spilled to is replaced by file, size bytes of it
+ */
+static int scull_spill_file(struct scull_spill *spill, struct file *file,
+		size_t size)
+	__must_hold(&spill->lock)
+{
+	struct gen_pool *pool;
+
+	if (spill->pool != NULL &&
+	    gen_pool_avail(spill->pool) != gen_pool_size(spill->pool))
+		return (-EBUSY);
+	if (size < SCULL_SPILL_BASE || size > ULONG_MAX - SCULL_SPILL_BASE)
+		return (-EINVAL);
+	if (scull_spill_used(spill, file))
+		return (-EBUSY);
+
+	pool = gen_pool_create(SCULL_SPILL_ORDER, NUMA_NO_NODE);
+	if (pool == NULL)
+		return (-ENOMEM);
+	if (gen_pool_add(pool, SCULL_SPILL_BASE, round_down(size,
+	    SCULL_SPILL_BASE), NUMA_NO_NODE)) {
+		gen_pool_destroy(pool);
+		return (-ENOMEM);
+	}
+	if (spill->pool != NULL)
+		gen_pool_destroy(spill->pool);
+	if (spill->file != NULL)
+		fput(spill->file);
+	spill->pool = pool;
+	spill->file = get_file(file);
+	WRITE_ONCE(spill->full, false);
+	return (0);
+}
+
+/*
+ * limit of dev and, unless NULL, its new backing file; a limit needs a
+ * file to spill to
+ */
+int scull_set_limit(struct scull_dev *dev, size_t limit, struct file *file,
+		size_t size)
+{
+	struct	scull_store	*store;
+	struct	scull_spill	*spill;
+	int	ret = 0;
+
+	if (__down_write_killable_sparse(&dev->lock))
+		return (-ERESTARTSYS);
+	spill = dev->spill;
+	if (spill == NULL) {
+		spill = scull_spill_alloc(dev);
+		if (spill == NULL) {
+			__up_write_sparse(&dev->lock);
+			return (-ENOMEM);
+		}
+		dev->spill = spill;
+	}
+	store = scull_store_locked(dev);
+	WRITE_ONCE(store->spill, spill);
+
+	mutex_lock(&spill->lock);
+	if (file != NULL) {
+		mutex_lock(&scull_spill_files);
+		ret = scull_spill_file(spill, file, size);
+		mutex_unlock(&scull_spill_files);
+	} else if (limit != 0 && spill->file == NULL)
+		ret = -EINVAL;
+	if (ret == 0)
+		WRITE_ONCE(spill->limit, limit);
+	mutex_unlock(&spill->lock);
+	if (ret == 0)
+		scull_spill_check(store);
+	__up_write_sparse(&dev->lock);
+	return (ret);
+}
+
+/*
+ * before the stores of dev go
+ */
+void scull_spill_cancel(struct scull_dev *dev)
+{
+
+	if (dev->spill != NULL)
+		cancel_work_sync(&dev->spill->work);
+}
+
+/*
+ * once the stores of dev are gone, with all that was spilled
+ */
+void scull_spill_destroy(struct scull_dev *dev)
+{
+	struct scull_spill *spill = dev->spill;
+
+	if (spill == NULL)
+		return;
+	if (spill->pool != NULL)
+		gen_pool_destroy(spill->pool);
+	if (spill->file != NULL)
+		fput(spill->file);
+	kfree(spill);
+	dev->spill = NULL;
+}
@@ -0,0 +1,93 @@
+#include <linux/mm.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+
+#include "scull.h"
+
+/*
+ * the pipe holds plain page references; nobody may steal a quantum
+ */
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+	.release =	generic_pipe_buf_release,
+	.get =		generic_pipe_buf_get,
+};
+
+static void scull_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+
+	put_page(spd->pages[i]);
+}
+
+/*
+ * page backed quanta go to the pipe by reference, holes as the zero
+ * page; the data stays shared with the device like the page cache is
+ * with a spliced file. Slab quanta are copied by the generic code
+ * through scull_read_iter().
+ *
+ * The references are taken under scull_srcu, a trim or a punched hole
+ * in the meantime leaves the pages to the pipe.
+ */
+ssize_t scull_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct	scull_dev	*dev = in->private_data;
+	struct	page		*pages[PIPE_DEF_BUFFERS];
+	struct	partial_page	 partial[PIPE_DEF_BUFFERS];
+	struct	splice_pipe_desc spd = {
+		.pages =	pages,
+		.partial =	partial,
+		.nr_pages_max =	PIPE_DEF_BUFFERS,
+		.ops =		&scull_pipe_buf_ops,
+		.spd_release =	scull_spd_release,
+	};
+	struct	scull_store	*store;
+	struct	scull_qset	*qset;
+	struct	scull_follow	 flw;
+	struct	page	*page;
+	void	*quantum;
+	loff_t	pos = *ppos;
+	size_t	end, chunk;
+	ssize_t	ret;
+	int	idx;
+
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	if (!store->pages) {
+		srcu_read_unlock(&scull_srcu, idx);
+		return (generic_file_splice_read(in, ppos, pipe, len, flags));
+	}
+
+	end = smp_load_acquire(&store->len);
+	if (pos < 0 || pos >= (loff_t)end) {
+		srcu_read_unlock(&scull_srcu, idx);
+		return (0);
+	}
+	len = min_t(size_t, len, end - pos);
+
+	while (len != 0 && spd.nr_pages < PIPE_DEF_BUFFERS) {
+		qset = __scull_follow(store, &flw, &pos);
+		quantum = NULL;
+		if (qset != NULL)
+			quantum = srcu_dereference(qset->data[flw.quantum_p],
+					&scull_srcu);
+		chunk = min(len, PAGE_SIZE - offset_in_page(flw.offset_p));
+		if (quantum != NULL)
+			page = virt_to_page(quantum + flw.offset_p);
+		else
+			page = ZERO_PAGE(0);
+		get_page(page);
+
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = offset_in_page(flw.offset_p);
+		partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+		pos += chunk;
+		len -= chunk;
+	}
+	srcu_read_unlock(&scull_srcu, idx);
+
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0)
+		*ppos += ret;
+	return (ret);
+}